@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2008-2009, Kalman Ham
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark for the collectors, outside WeeChat.  The plugin is built in
+ * with a stub plugin table that only has printf_date_tags and command,
+ * both going nowhere, and hook_fd, whose hook never fires, so the mount
+ * table is read once as it would be in WeeChat.  One op is what a
+ * /sys <name> costs when nothing else has sampled for it: run the
+ * collector(s), take the snapshot and format the line.  The allocation
+ * and syscall counts are of the calls sysinfo.c makes itself, through
+ * -Wl,--wrap (see the Makefile).
+ *
+ * -r runs against a tree from fixture.sh instead of the live /proc and
+ * /sys; uname and uptime still come from the system calls.
+ *
+ * Output is one tab separated line per case, after a "#" header unless
+ * -H is given.
+ */
+
+#include <stdarg.h>
+
+#include "sysinfo.c"
+
+static uint64_t	bench_allocs, bench_syscalls;
+
+#define COUNT(v)	__atomic_fetch_add(&(v), 1, __ATOMIC_RELAXED)
+
+void	*__real_malloc(size_t);
+void	*__real_calloc(size_t, size_t);
+void	*__real_realloc(void *, size_t);
+char	*__real_strdup(const char *);
+int	 __real_open(const char *, int, ...);
+int	 __real_openat(int, const char *, int, ...);
+ssize_t	 __real_read(int, void *, size_t);
+ssize_t	 __real_pread(int, void *, size_t, off_t);
+int	 __real_close(int);
+FILE	*__real_fopen(const char *, const char *);
+int	 __real_statvfs(const char *, struct statvfs *);
+int	 __real_uname(struct utsname *);
+#ifdef __linux__
+int	 __real_sysinfo(struct sysinfo *);
+#endif
+
+void *
+__wrap_malloc(size_t size)
+{
+	COUNT(bench_allocs);
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+	COUNT(bench_allocs);
+	return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+	COUNT(bench_allocs);
+	return __real_realloc(p, size);
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+	COUNT(bench_allocs);
+	return __real_strdup(s);
+}
+
+int
+__wrap_open(const char *path, int flags, ...)
+{
+	va_list	ap;
+	mode_t	mode = 0;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	COUNT(bench_syscalls);
+	return __real_open(path, flags, mode);
+}
+
+int
+__wrap_openat(int dirfd, const char *path, int flags, ...)
+{
+	va_list	ap;
+	mode_t	mode = 0;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	COUNT(bench_syscalls);
+	return __real_openat(dirfd, path, flags, mode);
+}
+
+ssize_t
+__wrap_read(int fd, void *buf, size_t len)
+{
+	COUNT(bench_syscalls);
+	return __real_read(fd, buf, len);
+}
+
+ssize_t
+__wrap_pread(int fd, void *buf, size_t len, off_t off)
+{
+	COUNT(bench_syscalls);
+	return __real_pread(fd, buf, len, off);
+}
+
+int
+__wrap_close(int fd)
+{
+	COUNT(bench_syscalls);
+	return __real_close(fd);
+}
+
+FILE *
+__wrap_fopen(const char *path, const char *mode)
+{
+	COUNT(bench_syscalls);
+	return __real_fopen(path, mode);
+}
+
+int
+__wrap_statvfs(const char *path, struct statvfs *buf)
+{
+	COUNT(bench_syscalls);
+	return __real_statvfs(path, buf);
+}
+
+int
+__wrap_uname(struct utsname *buf)
+{
+	COUNT(bench_syscalls);
+	return __real_uname(buf);
+}
+
+#ifdef __linux__
+int
+__wrap_sysinfo(struct sysinfo *info)
+{
+	COUNT(bench_syscalls);
+	return __real_sysinfo(info);
+}
+#endif
+
+static void
+bench_printf(struct t_gui_buffer *buffer, time_t date, const char *tags,
+    const char *message, ...)
+{
+}
+
+static void
+bench_command(struct t_weechat_plugin *plugin, struct t_gui_buffer *buffer,
+    const char *command)
+{
+}
+
+static struct t_hook *
+bench_hook_fd(struct t_weechat_plugin *plugin, int fd, int flag_read,
+    int flag_write, int flag_exception,
+    int (*callback)(void *data, int fd), void *data)
+{
+	static char	hook;
+
+	return (struct t_hook *)&hook;
+}
+
+static struct t_weechat_plugin bench_plugin;
+
+static void
+bench_op(const char *name)
+{
+	char	*argv[] = { "/sys", (char *)name, NULL };
+	size_t	 i;
+
+	for (i = 0; i < NCOLLECTORS; i++)
+		if (!strcmp(name, "all") ? (collectors[i].flags & C_ALL) :
+		    !strcmp(name, collectors[i].name))
+			collector_call(&collectors[i]);
+	memcpy(&snapshot, &sample_work.w, sizeof(snapshot));
+	weenfo_cmd(NULL, NULL, 2, argv, argv);
+}
+
+static const char	*bench_root = "/";
+
+static void
+bench_case(const char *name, long iters)
+{
+	uint64_t	allocs, syscalls;
+	int64_t		t0, ns;
+	long		i;
+
+	bench_op(name);		/* warm up */
+	allocs = bench_allocs;
+	syscalls = bench_syscalls;
+	t0 = mono_ns();
+	for (i = 0; i < iters; i++)
+		bench_op(name);
+	ns = mono_ns() - t0;
+	printf("%s\t%s\t%ld\t%.1f\t%.2f\t%.2f\n", bench_root, name, iters,
+	    (double)ns / iters,
+	    (double)(bench_allocs - allocs) / iters,
+	    (double)(bench_syscalls - syscalls) / iters);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long	iters = 1000;
+	size_t	i;
+	int	ch, header = 1;
+
+	while ((ch = getopt(argc, argv, "Hr:")) != -1)
+		switch (ch) {
+		case 'H':
+			header = 0;
+			break;
+		case 'r':
+			bench_root = optarg;
+#ifdef __linux__
+			snprintf(proc_root, sizeof(proc_root), "%s/proc",
+			    optarg);
+			snprintf(sys_root, sizeof(sys_root), "%s/sys", optarg);
+#endif
+			break;
+		default:
+			goto usage;
+		}
+	if (optind < argc && (iters = atol(argv[optind])) < 1)
+		goto usage;
+
+	bench_plugin.printf_date_tags = bench_printf;
+	bench_plugin.command = bench_command;
+	bench_plugin.hook_fd = bench_hook_fd;
+	weechat_plugin = &bench_plugin;
+#ifdef __linux__
+	procfs_init();
+	cpu_init();
+	probe_init();
+	cpu_model_read();
+	/* The plugin's default filters, as config_read applies them. */
+	disk_fstypes = list_split(DISK_FSTYPES, &disk_nfstypes);
+	disk_mounts = list_split(DISK_MOUNTS, &disk_nmounts);
+#endif
+
+	if (header)
+		printf("# root\tcase\titers\tns/op\tallocs/op\t"
+		    "syscalls/op\n");
+	bench_case("all", iters);
+	for (i = 0; i < NCOLLECTORS; i++)
+		bench_case(collectors[i].name, iters);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-H] [-r root] [iterations]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Write a synthetic procfs/sysfs tree for a host with the given number of
+# CPUs and mounts, for sysinfo-bench -r (see "make scale").  The mounts
+# point at empty directories under the tree, each with a device of its
+# own, so every one of them is counted and probed.
+#
+# usage: fixture.sh dir cpus mounts
+
+if [ $# -ne 3 ]; then
+	echo "usage: $0 dir cpus mounts" >&2
+	exit 1
+fi
+
+cpus=$2
+mounts=$3
+
+rm -rf "$1" && mkdir -p "$1/proc/self" "$1/sys/devices/system/cpu" \
+    "$1/mnt" || exit 1
+root=$(cd "$1" && pwd) || exit 1
+
+awk -v cpus="$cpus" -v mounts="$mounts" -v root="$root" '
+BEGIN {
+	proc = root "/proc"
+	sys = root "/sys/devices/system/cpu"
+
+	for (i = 0; i < cpus; i++) {
+		printf "processor\t: %d\n", i > (proc "/cpuinfo")
+		printf "model name\t: Synthetic CPU @ 2.40GHz\n" > (proc "/cpuinfo")
+		printf "cpu MHz\t\t: %.3f\n\n", 2400 + i % 7 > (proc "/cpuinfo")
+	}
+
+	u = 1000 * cpus
+	printf "cpu  %d %d %d %d %d %d %d %d 0 0\n", u * 4, u, u * 2, u * 40,
+	    u / 2, u / 10, u / 10, 0 > (proc "/stat")
+	for (i = 0; i < cpus; i++)
+		printf "cpu%d %d %d %d %d %d %d %d %d 0 0\n", i,
+		    4000 + i, 1000, 2000 + i % 13, 40000, 500, 100, 100,
+		    0 > (proc "/stat")
+	printf "intr 0\nctxt 0\nbtime 0\nprocesses 1\n" > (proc "/stat")
+	printf "procs_running 1\nprocs_blocked 0\nsoftirq 0\n" > (proc "/stat")
+
+	kb = cpus * 4 * 1048576
+	printf "MemTotal:       %d kB\n", kb > (proc "/meminfo")
+	printf "MemFree:        %d kB\n", kb / 4 > (proc "/meminfo")
+	printf "MemAvailable:   %d kB\n", kb / 2 > (proc "/meminfo")
+	printf "Buffers:        %d kB\n", kb / 32 > (proc "/meminfo")
+	printf "Cached:         %d kB\n", kb / 8 > (proc "/meminfo")
+	printf "SwapCached:     0 kB\n" > (proc "/meminfo")
+	printf "SwapTotal:      0 kB\n" > (proc "/meminfo")
+	printf "SwapFree:       0 kB\n" > (proc "/meminfo")
+
+	printf "%.2f %.2f %.2f 1/%d 4242\n", cpus / 2, cpus / 3, cpus / 4,
+	    cpus * 100 > (proc "/loadavg")
+
+	mnt = root "/mnt"
+	gsub(/ /, "\\040", mnt)
+	printf "1 0 8:1 / / rw - ext4 /dev/sda1 rw\n" > (proc "/self/mountinfo")
+	for (i = 0; i < mounts; i++)
+		printf "%d 1 %d:%d / %s/%d rw - ext4 /dev/sdx%d rw\n",
+		    i + 2, 259 + int(i / 1048576), i % 1048576, mnt, i,
+		    i > (proc "/self/mountinfo")
+	printf "" > (proc "/self/mounts")
+}' || exit 1
+
+i=0
+while [ $i -lt "$cpus" ]; do
+	d="$root/sys/devices/system/cpu/cpu$i/cpufreq"
+	mkdir -p "$d" && echo $((2400000 + i % 7 * 1000)) \
+	    > "$d/scaling_cur_freq" || exit 1
+	i=$((i + 1))
+done
+
+cd "$root/mnt" || exit 1
+i=0
+while [ $i -lt "$mounts" ]; do
+	echo $i
+	i=$((i + 1))
+done | xargs mkdir -p || exit 1
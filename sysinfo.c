@@ -24,12 +24,23 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/utsname.h>
 #include <sys/statvfs.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "weechat-plugin.h"
 
@@ -37,7 +48,13 @@
 #ifdef __linux__
 
 #include <sys/sysinfo.h>
-#include <mntent.h>
+#include <sys/sysmacros.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
 
 #elif defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
 
@@ -57,6 +74,37 @@
 
 #endif
 
+/*
+ * Static probes for perf and bpftrace, built in with make SDT=1:
+ *
+ *	collector__entry(name)		collector__return(name, ns)
+ *	command__entry(cmd, sub)	command__return(cmd, sub, ns)
+ *
+ * Each is a nop in the code and a note in the ELF file; without SDT they
+ * are not there at all.  Each has a semaphore, which the tracer bumps while
+ * attached, so PROBE_ENABLED() can skip work done only for a probe.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define PROBE1(name, a)		DTRACE_PROBE1(sysinfo, name, a)
+#define PROBE2(name, a, b)	DTRACE_PROBE2(sysinfo, name, a, b)
+#define PROBE3(name, a, b, c)	DTRACE_PROBE3(sysinfo, name, a, b, c)
+#define PROBE_ENABLED(name)	__builtin_expect(sysinfo_##name##_semaphore, 0)
+#define PROBE_SEMAPHORE(name)						\
+	unsigned short sysinfo_##name##_semaphore			\
+	    __attribute__((section(".probes"), used, visibility("hidden")))
+
+PROBE_SEMAPHORE(collector__entry);
+PROBE_SEMAPHORE(collector__return);
+PROBE_SEMAPHORE(command__entry);
+PROBE_SEMAPHORE(command__return);
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
 #define BSIZE 256
 #define LINESIZE 512
 
@@ -80,6 +128,28 @@ typedef struct {
 	char	load[32];
 	char	mem[64];
 	char	disk[64];
+	char	cpuload[256];
+
+	/* The raw values behind the strings, for the info API. */
+	char		os_name[65];
+	char		os_release[65];
+	char		os_machine[65];
+	char		cpu_model[BSIZE];
+	double		cpu_mhz;
+	double		cpu_mhz_min;
+	double		cpu_mhz_max;
+	double		cpu_busy;
+	double		cpu_user;
+	double		cpu_system;
+	double		cpu_iowait;
+	double		cpu_steal;
+	uint64_t	uptime_sec;
+	double		loadavg[3];
+	uint64_t	mem_total_kb;
+	uint64_t	mem_used_kb;
+	uint64_t	disk_total_kb;
+	uint64_t	disk_used_kb;
+	uint64_t	disk_stale;
 } weenfo;
 
 struct line_t {
@@ -87,41 +157,574 @@ struct line_t {
 	int	len;
 };
 
+/*
+ * Every collector is refreshed by the sampler thread, and the main thread
+ * keeps a copy of the latest sample in the snapshot, so /sys and /esys
+ * only format what is already there.  The collector table is the one
+ * place a new one goes: commands, help and completion come from it.
+ */
+#define C_ALL	0x01		/* part of "all" */
+#define C_SLOW	0x02		/* can block, left out of the first sample */
+
+struct collector {
+	const char	*name;
+	const char	*alias;		/* or NULL */
+	int		(*func)(weenfo *);
+	void		(*format)(const struct collector *, const weenfo *,
+			    struct line_t *);
+	size_t		 field;		/* its string in weenfo */
+	int		 defint;	/* default interval, in seconds */
+	int		 flags;
+	int		 shed;		/* budget level it waits at, or 0 */
+
+	int		 interval;
+	int		 imin;		/* bounds for cur */
+	int		 imax;
+	int		 cur;		/* adapted interval */
+	struct timeval	 last;
+	uint64_t	 runs;		/* samples taken in so far */
+	long		 cost_us;	/* average run time */
+	uint64_t	 due;		/* sampler ticks */
+	uint64_t	 next;
+};
+
+static weenfo		 snapshot;
+
+/*
+ * Recent history of every numeric info, one ring per metric with the
+ * timestamps and values in separate arrays.  history.size bounds each.
+ */
+struct ring {
+	time_t		*t;
+	double		*v;
+	size_t		 size;
+	size_t		 head;	/* next slot to write */
+	size_t		 count;
+};
+
+static size_t		 history_size = 3600;
+
+/*
+ * Long-term history: sealed blocks compressed the Gorilla way (delta of
+ * delta timestamps, XOR'd values), behind an open block of raw samples
+ * that takes the appends.  Sealed blocks are never modified, only
+ * dropped once they fall out of history.retention.
+ */
+#define SERIES_BLOCK 256
+
+struct block {
+	time_t		 t0;	/* first and last sample */
+	time_t		 t1;
+	uint32_t	 n;
+	uint32_t	 len;	/* bytes of data */
+	uint8_t		*data;
+};
+
+struct series {
+	time_t		 ht[SERIES_BLOCK];
+	double		 hv[SERIES_BLOCK];
+	int		 hn;
+	struct block	*blocks;
+	size_t		 first;	/* oldest block still kept */
+	size_t		 nblocks;
+	size_t		 blocks_size;
+};
+
+static long		 history_retention = 30 * 86400;	/* seconds */
+
+/*
+ * Per-minute and per-hour rollups of the same samples, folded in as
+ * they arrive so that long windows never have to look at raw samples.
+ * The minute tier keeps a day, the hour tier all of history.retention.
+ */
+struct bucket {
+	time_t	t;	/* start of the period */
+	double	min, max, sum;
+	size_t	n;
+};
+
+struct tier {
+	struct bucket	*b;
+	size_t		 size;
+	size_t		 head;	/* the open bucket */
+	size_t		 count;
+};
+
+#define NTIERS 2
+static const long	 tier_step[NTIERS] = { 60, 3600 };
+#define TIER_MINUTES 1440
+
+/* Default query resolution, as a fraction of the window. */
+#define HISTORY_POINTS 100
+
+/*
+ * Bar items render from the snapshot on their own timer and only ask
+ * WeeChat for a redraw when the text differs from what is on screen.
+ */
+struct baritem {
+	const char	*name;
+	const char	*field;		/* NULL for the combined item */
+	char		 text[LINESIZE];
+};
+
+static struct baritem baritems[] = {
+	{ "sysinfo",		NULL,		"" },
+	{ "sysinfo_cpu",	"cpu",		"" },
+	{ "sysinfo_cpuload",	"cpuload",	"" },
+	{ "sysinfo_mem",	"mem",		"" },
+	{ "sysinfo_load",	"load",		"" },
+	{ "sysinfo_disk",	"disk",		"" },
+};
+
+#define NBARITEMS (sizeof(baritems) / sizeof(baritems[0]))
+#define BAR_FIELDS "load,mem,disk"
+
+static struct t_hook	*bar_hook = NULL;
+static int		 bar_interval = 1;	/* seconds */
+static int		 bar_hooked;
+static char		**bar_fields = NULL;
+static int		 bar_nfields;
+
+#define PROBE_MAXWORKERS 32
+
+static int		 disk_timeout = 500;	/* per mount, in ms */
+static int		 disk_workers = 4;
+
+#define CPULOAD_MAXTOP 16
+
+static int		 cpuload_top = 4;
+
+static int64_t
+thread_cpu_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef __linux__
+
+/*
+ * Where procfs, sysfs and the mount table (in mountinfo format) are read
+ * from, so that the plugin can be pointed at a copy of another machine.
+ * They are set once at load, before anything is opened.
+ */
+static char	 proc_root[BSIZE] = "/proc";
+static char	 sys_root[BSIZE] = "/sys";
+static char	 mtab_path[BSIZE];	/* or proc_root/self/mountinfo */
+
+static const char *
+root_path(char *buf, size_t size, const char *root, const char *path)
+{
+	snprintf(buf, size, "%s%s", root, path);
+	return buf;
+}
+
+/*
+ * A procfs file opened once and re-read with a single pread() into a
+ * buffer of its own.  The buffer only grows when the file outgrows it.
+ */
+struct pfile {
+	int	 fd;
+	char	*buf;
+	size_t	 size;
+	size_t	 len;
+};
+
+/*
+ * One "Key: value" line to pick out of a pfile; key includes the colon.
+ */
+struct pfield {
+	const char	*key;
+	size_t		 keylen;
+	uint64_t	*val;
+};
+
+#define PFIELD(k, v) { k, sizeof(k) - 1, v }
+
+static struct pfile	pf_meminfo = { -1, NULL, 0, 0 };
+static struct pfile	pf_loadavg = { -1, NULL, 0, 0 };
+
 static int
-cpu_info(weenfo *info)
+pfile_open(struct pfile *pf, const char *path, size_t size)
 {
-	char	cpu[BSIZE];
-	float	mhz = 0;
+	if ((pf->fd = open(path, O_RDONLY)) == -1)
+		return 1;
+	if ((pf->buf = malloc(size)) == NULL) {
+		close(pf->fd);
+		pf->fd = -1;
+		return 1;
+	}
+	pf->size = size;
+	pf->len = 0;
+
+	return 0;
+}
+
+static void
+pfile_close(struct pfile *pf)
+{
+	if (pf->fd != -1)
+		close(pf->fd);
+	free(pf->buf);
+	pf->fd = -1;
+	pf->buf = NULL;
+	pf->size = pf->len = 0;
+}
+
+static int
+pfile_read(struct pfile *pf)
+{
+	ssize_t	 len;
+	char	*p;
+
+	if (pf->fd == -1)
+		return 1;
+	for (;;) {
+		if ((len = pread(pf->fd, pf->buf, pf->size - 1, 0)) < 0)
+			return 1;
+		if ((size_t)len < pf->size - 1)
+			break;
+		if ((p = realloc(pf->buf, pf->size * 2)) == NULL)
+			break;
+		pf->buf = p;
+		pf->size *= 2;
+	}
+	pf->buf[len] = '\0';
+	pf->len = len;
+
+	return 0;
+}
+
+static uint64_t
+pnum(const char **s)
+{
+	const char	*p = *s;
+	uint64_t	 v = 0;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	while (*p >= '0' && *p <= '9')
+		v = v * 10 + (*p++ - '0');
+	*s = p;
+
+	return v;
+}
+
+/*
+ * Fixed point, in hundredths; procfs never prints more than two decimals
+ * where we use this, and strtod() would follow WeeChat's locale.
+ */
+static uint64_t
+pfix(const char **s)
+{
+	const char	*p;
+	uint64_t	 v;
+
+	v = pnum(s) * 100;
+	p = *s;
+	if (*p == '.') {
+		p++;
+		if (*p >= '0' && *p <= '9')
+			v += (*p++ - '0') * 10;
+		if (*p >= '0' && *p <= '9')
+			v += *p++ - '0';
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+	*s = p;
+
+	return v;
+}
+
+/*
+ * Fill in the fields found in the buffer; returns how many were.
+ */
+static int
+pfile_scan(struct pfile *pf, const struct pfield *fields, int nfields)
+{
+	const char	*p = pf->buf, *end = pf->buf + pf->len;
+	int		 i, found = 0;
+
+	while (p < end && found < nfields) {
+		for (i = 0; i < nfields; i++) {
+			if (strncmp(p, fields[i].key, fields[i].keylen))
+				continue;
+			p += fields[i].keylen;
+			*fields[i].val = pnum(&p);
+			found++;
+			break;
+		}
+		if ((p = memchr(p, '\n', end - p)) == NULL)
+			break;
+		p++;
+	}
+
+	return found;
+}
+
+static void
+procfs_init(void)
+{
+	char	path[2 * BSIZE];
+
+	pfile_open(&pf_meminfo,
+	    root_path(path, sizeof(path), proc_root, "/meminfo"), 4096);
+	pfile_open(&pf_loadavg,
+	    root_path(path, sizeof(path), proc_root, "/loadavg"), 128);
+}
+
+static void
+procfs_end(void)
+{
+	pfile_close(&pf_meminfo);
+	pfile_close(&pf_loadavg);
+}
+
+#endif /* __linux__ */
 
 #ifdef __linux__
 
+/*
+ * The model never changes, so /proc/cpuinfo is read once, or not at all
+ * when /upgrade handed it over; the clock comes from the per-core cpufreq
+ * files.  Only their directory stays open: one fd per core would be a
+ * thousand on a big host, and WeeChat's select() loop can't have that.
+ */
+static char	 cpu_model[BSIZE] = "Unknown";
+static float	 cpu_model_mhz;
+static int	 cpu_model_known;
+
+static int	 cpufreq_dir = -1;	/* sys_root/devices/system/cpu */
+static int	*cpufreq = NULL;	/* the cores that have the file */
+static int	 ncpufreq;
+
+/*
+ * /proc/stat counters from the previous sample, and the utilisation they
+ * gave; slot 0 is the machine total and slot i + 1 is core i.
+ */
+struct cpustat {
+	uint64_t	user, nice, system, idle, iowait, irq, softirq, steal;
+};
+
+struct cpuload {
+	float		user, system, iowait, steal, busy;
+	long		khz;
+	int		online;
+};
+
+static struct pfile	 pf_stat = { -1, NULL, 0, 0 };
+static struct cpustat	*cpu_prev = NULL;
+static struct cpuload	*cpu_load = NULL;
+static struct cpuload	*cpu_slot[2];	/* published with the sample */
+static int		 cpu_nslots;
+
+static void
+cpu_model_read(void)
+{
 	FILE	*fp;
-	char	 line[BSIZE];
+	char	 line[BSIZE], path[2 * BSIZE];
 	char	*pos;
+	int	 model = 0, mhz = 0;
 
-	if ((fp = fopen("/proc/cpuinfo", "r")) == NULL)
-		return 1;
+	if ((fp = fopen(root_path(path, sizeof(path), proc_root, "/cpuinfo"),
+	    "r")) != NULL) {
+		while ((!model || !mhz) && fgets(line, BSIZE, fp) != NULL) {
+			if ((pos = strchr(line, ':')) == NULL)
+				continue;
+			if (!model && !strncmp(line, "model name", 10)) {
+				strncpy(cpu_model, pos + 2, sizeof(cpu_model));
+				cpu_model[sizeof(cpu_model) - 1] = '\0';
+				cpu_model[strcspn(cpu_model, "\n")] = '\0';
+				model = 1;
+			} else if (!mhz && !strncmp(line, "cpu MHz", 7)) {
+				cpu_model_mhz = atof(pos + 2);
+				mhz = 1;
+			}
+		}
+		fclose(fp);
+	}
+	cpu_model_known = 1;
+}
+
+/*
+ * The cores sysfs knows of, online or not, as _SC_NPROCESSORS_CONF counts
+ * them, but under sys_root.
+ */
+static int
+cpu_count(void)
+{
+	DIR		*dir;
+	struct dirent	*de;
+	char		 path[2 * BSIZE];
+	const char	*p;
+	int		 n = 0;
+
+	if ((dir = opendir(root_path(path, sizeof(path), sys_root,
+	    "/devices/system/cpu"))) == NULL)
+		return sysconf(_SC_NPROCESSORS_CONF);
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, "cpu", 3))
+			continue;
+		for (p = de->d_name + 3; *p >= '0' && *p <= '9'; p++)
+			;
+		if (p > de->d_name + 3 && *p == '\0')
+			n++;
+	}
+	closedir(dir);
+
+	return n ? n : sysconf(_SC_NPROCESSORS_CONF);
+}
+
+#define CPUFREQ_FILE	"cpu%d/cpufreq/scaling_cur_freq"
+
+/* A core's current clock in kHz, or -1. */
+static long
+cpufreq_read(int cpu)
+{
+	char		 name[64], buf[32];
+	const char	*p = buf;
+	ssize_t		 len;
+	int		 fd;
 
-	while (fgets(line, BSIZE, fp) != NULL) {
-		if (strstr(line, "model name")) {
-			pos = strchr(line, ':');
-			strncpy(cpu, pos + 2, sizeof(cpu));
-			cpu[sizeof(cpu) - 1] = '\0';
-		} else if (strstr(line, "cpu MHz")) {
-			pos = strchr(line, ':');
-			mhz = atof(pos + 2);
+	snprintf(name, sizeof(name), CPUFREQ_FILE, cpu);
+	if ((fd = openat(cpufreq_dir, name, O_RDONLY)) == -1)
+		return -1;
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	return pnum(&p);
+}
+
+static void
+cpu_init(void)
+{
+	char	name[64], path[2 * BSIZE];
+	int	i, ncpu;
+
+	if ((ncpu = cpu_count()) < 1 ||
+	    (cpufreq = calloc(ncpu, sizeof(*cpufreq))) == NULL)
+		return;
+	if ((cpufreq_dir = open(root_path(path, sizeof(path), sys_root,
+	    "/devices/system/cpu"), O_RDONLY | O_DIRECTORY)) != -1)
+		for (i = 0; i < ncpu; i++) {
+			snprintf(name, sizeof(name), CPUFREQ_FILE, i);
+			if (faccessat(cpufreq_dir, name, R_OK, 0) == 0)
+				cpufreq[ncpufreq++] = i;
 		}
+
+	if ((cpu_prev = calloc(ncpu + 1, sizeof(*cpu_prev))) == NULL ||
+	    (cpu_load = calloc(ncpu + 1, sizeof(*cpu_load))) == NULL ||
+	    (cpu_slot[0] = calloc(ncpu + 1, sizeof(*cpu_load))) == NULL ||
+	    (cpu_slot[1] = calloc(ncpu + 1, sizeof(*cpu_load))) == NULL)
+		return;
+	cpu_nslots = ncpu + 1;
+	pfile_open(&pf_stat, root_path(path, sizeof(path), proc_root, "/stat"),
+	    4096 + ncpu * 160);
+}
+
+static void
+cpu_end(void)
+{
+	if (cpufreq_dir != -1)
+		close(cpufreq_dir);
+	cpufreq_dir = -1;
+	free(cpufreq);
+	cpufreq = NULL;
+	ncpufreq = 0;
+
+	pfile_close(&pf_stat);
+	free(cpu_prev);
+	free(cpu_load);
+	free(cpu_slot[0]);
+	free(cpu_slot[1]);
+	cpu_prev = NULL;
+	cpu_load = NULL;
+	cpu_slot[0] = cpu_slot[1] = NULL;
+	cpu_nslots = 0;
+}
+
+static void
+cpustat_delta(struct cpustat *prev, const struct cpustat *cur,
+    struct cpuload *l)
+{
+	uint64_t	user, system, idle, iowait, steal, total;
+
+	user   = (cur->user + cur->nice) - (prev->user + prev->nice);
+	system = (cur->system + cur->irq + cur->softirq) -
+	    (prev->system + prev->irq + prev->softirq);
+	idle   = cur->idle - prev->idle;
+	iowait = cur->iowait - prev->iowait;
+	steal  = cur->steal - prev->steal;
+	total  = user + system + idle + iowait + steal;
+	*prev = *cur;
+
+	/* Counters went backwards (core hotplug) or did not move at all. */
+	if (total == 0 || total > (uint64_t)INT64_MAX)
+		return;
+	l->user   = (float)user * 100 / total;
+	l->system = (float)system * 100 / total;
+	l->iowait = (float)iowait * 100 / total;
+	l->steal  = (float)steal * 100 / total;
+	l->busy   = l->user + l->system + l->steal;
+}
+
+#endif /* __linux__ */
+
+static int
+cpu_info(weenfo *info)
+{
+	char	cpu[BSIZE];
+	float	mhz = 0;
+
+#ifdef __linux__
+
+	long		 khz, min = 0, max = 0, sum = 0;
+	int		 i, n = 0;
+
+	for (i = 0; i < ncpufreq; i++) {
+		if ((khz = cpufreq_read(cpufreq[i])) < 0)
+			continue;
+		if (cpufreq[i] + 1 < cpu_nslots)
+			cpu_load[cpufreq[i] + 1].khz = khz;
+		if (n == 0 || khz < min)
+			min = khz;
+		if (n == 0 || khz > max)
+			max = khz;
+		sum += khz;
+		n++;
 	}
-	fclose(fp);
 
-	/* Cut off the line feed. */
-	cpu[strlen(cpu) - 1] = '\0';
+	strncpy(info->cpu_model, cpu_model, sizeof(info->cpu_model));
+	if (n) {
+		info->cpu_mhz = (double)sum / n / 1000;
+		info->cpu_mhz_min = (double)min / 1000;
+		info->cpu_mhz_max = (double)max / 1000;
+	} else
+		info->cpu_mhz = info->cpu_mhz_min = info->cpu_mhz_max =
+		    cpu_model_mhz;
+
+	if (n == 0 || min == max)
+		snprintf(info->cpu, sizeof(info->cpu), "CPU: %s (%.2f GHz)",
+		    cpu_model, n ? (float)max / 1000000 : cpu_model_mhz / 1000);
+	else
+		snprintf(info->cpu, sizeof(info->cpu),
+		    "CPU: %.200s (%.2f GHz avg, %.2f-%.2f)", cpu_model,
+		    (float)sum / n / 1000000,
+		    (float)min / 1000000, (float)max / 1000000);
+	return 0;
 
 #elif defined(__NetBSD__)
 
 	size_t size = sizeof(cpu);
 	sysctlbyname("machdep.cpu_brand", &cpu, &size, NULL, 0);
 
+	strncpy(info->cpu_model, cpu, sizeof(info->cpu_model));
+	info->cpu_mhz = info->cpu_mhz_min = info->cpu_mhz_max = 0;
 	snprintf(info->cpu, sizeof(info->cpu), "CPU: %s", cpu);
 	return 0;
 
@@ -177,6 +780,9 @@ cpu_info(weenfo *info)
 	kstat_close(kc);
 #endif
 
+	strncpy(info->cpu_model, cpu, sizeof(info->cpu_model));
+	info->cpu_model[sizeof(info->cpu_model) - 1] = '\0';
+	info->cpu_mhz = info->cpu_mhz_min = info->cpu_mhz_max = mhz;
 	snprintf(info->cpu, sizeof(info->cpu), "CPU: %s (%.2f GHz)",
 	    cpu, mhz / 1000);
 
@@ -189,12 +795,100 @@ uname_info(weenfo *info)
 	struct utsname n;
 	uname(&n);
 
+	snprintf(info->os_name, sizeof(info->os_name), "%s", n.sysname);
+	snprintf(info->os_release, sizeof(info->os_release), "%s", n.release);
+	snprintf(info->os_machine, sizeof(info->os_machine), "%s", n.machine);
 	snprintf(info->uname, sizeof(info->uname),
 	    "OS: %s %s/%s", n.sysname, n.release, n.machine);
 
 	return 0;
 }
 
+/*
+ * CPU utilisation between two samples, with the busiest cores listed so
+ * the line stays short however many there are.
+ */
+static int
+cpuload_info(weenfo *info)
+{
+#ifdef __linux__
+
+	struct cpustat	 cur;
+	struct cpuload	*l;
+	const char	*p, *end;
+	int		 top[CPULOAD_MAXTOP];
+	int		 i, j, k, idx, ntop = 0, len;
+
+	if (cpu_nslots == 0 || pfile_read(&pf_stat))
+		return 1;
+
+	for (i = 0; i < cpu_nslots; i++)
+		cpu_load[i].online = 0;
+	p = pf_stat.buf;
+	end = p + pf_stat.len;
+	while (p < end && !strncmp(p, "cpu", 3)) {
+		p += 3;
+		idx = *p == ' ' ? 0 : (int)pnum(&p) + 1;
+		cur.user    = pnum(&p);
+		cur.nice    = pnum(&p);
+		cur.system  = pnum(&p);
+		cur.idle    = pnum(&p);
+		cur.iowait  = pnum(&p);
+		cur.irq     = pnum(&p);
+		cur.softirq = pnum(&p);
+		cur.steal   = pnum(&p);
+		if (idx < cpu_nslots) {
+			cpustat_delta(&cpu_prev[idx], &cur, &cpu_load[idx]);
+			cpu_load[idx].online = 1;
+		}
+		if ((p = memchr(p, '\n', end - p)) == NULL)
+			break;
+		p++;
+	}
+
+	l = &cpu_load[0];
+	info->cpu_busy   = l->busy;
+	info->cpu_user   = l->user;
+	info->cpu_system = l->system;
+	info->cpu_iowait = l->iowait;
+	info->cpu_steal  = l->steal;
+	len = snprintf(info->cpuload, sizeof(info->cpuload),
+	    "CPU Usage: %.1f%% (us %.1f, sy %.1f, wa %.1f, st %.1f)",
+	    l->busy, l->user, l->system, l->iowait, l->steal);
+
+	if (cpu_nslots <= 2 || cpuload_top <= 0)
+		return 0;
+
+	/* Keep the busiest cores in top[], busiest first. */
+	for (i = 1; i < cpu_nslots; i++) {
+		if (!cpu_load[i].online)
+			continue;
+		for (j = ntop; j > 0 &&
+		    cpu_load[top[j - 1]].busy < cpu_load[i].busy; j--)
+			;
+		if (j >= cpuload_top)
+			continue;
+		if (ntop < cpuload_top)
+			ntop++;
+		for (k = ntop - 1; k > j; k--)
+			top[k] = top[k - 1];
+		top[j] = i;
+	}
+	for (i = 0; i < ntop && len < (int)sizeof(info->cpuload); i++)
+		len += snprintf(info->cpuload + len,
+		    sizeof(info->cpuload) - len, "%s cpu%d %.0f%%",
+		    i ? "," : ", top:", top[i] - 1, cpu_load[top[i]].busy);
+
+#else
+
+	snprintf(info->cpuload, sizeof(info->cpuload),
+	    "CPU Usage: unavailable");
+
+#endif
+
+	return 0;
+}
+
 static void
 add_to_uptime(weenfo *info, char c, int i)
 {
@@ -251,6 +945,7 @@ uptime_info(weenfo *info)
 	kstat_close(kc);
 #endif
 
+	info->uptime_sec = btime;
 	week = (uint32_t) btime / (7 * 24 * 3600);
 	day  = (uint32_t)(btime / (24 * 3600)) % 7;
 	hour = (uint32_t)(btime / 3600) % 24;
@@ -271,7 +966,19 @@ load_info(weenfo *info)
 {
 	double lavg[3];
 
+#ifdef __linux__
+	const char *p;
+
+	if (pfile_read(&pf_loadavg))
+		return 1;
+	p = pf_loadavg.buf;
+	lavg[0] = (double)pfix(&p) / 100;
+	lavg[1] = (double)pfix(&p) / 100;
+	lavg[2] = (double)pfix(&p) / 100;
+#else
 	getloadavg(lavg, sizeof(lavg) / sizeof(lavg[0]));
+#endif
+	memcpy(info->loadavg, lavg, sizeof(info->loadavg));
 	snprintf(info->load, sizeof(info->load),
 	    "Load Average: %.2f", lavg[0]);
 
@@ -288,31 +995,22 @@ mem_info(weenfo *info)
 	uint32_t cachedMem  = 0;
 
 #ifdef __linux__
-	FILE	*fp;
-	char	 buffer[BSIZE];
+	uint64_t mt = 0, mf = 0, mb = 0, mc = 0;
+	const struct pfield fields[] = {
+		PFIELD("MemTotal:", &mt),
+		PFIELD("MemFree:", &mf),
+		PFIELD("Buffers:", &mb),
+		PFIELD("Cached:", &mc),
+	};
 
-	char	*pos = NULL;
-
-	if ((fp = fopen("/proc/meminfo", "r")) == NULL)
+	if (pfile_read(&pf_meminfo))
 		return 1;
+	pfile_scan(&pf_meminfo, fields, sizeof(fields) / sizeof(fields[0]));
 
-	while (fgets(buffer, BSIZE, fp) != NULL) {
-		if (!strncmp(buffer, "MemTotal:", 9)) {
-			pos = strchr(buffer, ':');
-			totalMem = atoi(pos + 2);
-		} else if(!strncmp(buffer, "MemFree:", 8)) {
-			pos = strchr(buffer, ':');
-			freeMem = atoi(pos + 2);
-		} else if(!strncmp(buffer, "Buffers:", 8)) {
-			pos = strchr(buffer, ':');
-			bufMem = atoi(pos + 2);
-		} else if(!strncmp(buffer, "Cached:", 7)) {
-			pos = strchr(buffer, ':');
-			cachedMem = atoi(pos + 2);
-		}
-	}
-	fclose(fp);
-
+	totalMem  = mt;
+	freeMem   = mf;
+	bufMem    = mb;
+	cachedMem = mc;
 	usedMem = totalMem - freeMem - bufMem - cachedMem;
 
 #elif defined(__NetBSD__) || defined(__OpenBSD__)
@@ -383,6 +1081,8 @@ mem_info(weenfo *info)
 	kstat_close(kc);
 #endif
 
+	info->mem_total_kb = totalMem;
+	info->mem_used_kb = usedMem;
 	snprintf(info->mem, sizeof(info->mem),
 	    "Memory Usage: %.2fMB/%dMB (%.2f%%)",
 	    (float)usedMem / 1024, totalMem >> 10,
@@ -391,157 +1091,3650 @@ mem_info(weenfo *info)
 	return 0;
 }
 
-static int
-disk_info(weenfo *info)
-{
-	uint64_t total = 0,
-		 used  = 0;
 #ifdef __linux__
-	FILE		*mtab;
-	struct mntent	*mnt;
-	struct statvfs	 buf;
 
-	if ((mtab = setmntent("/etc/mtab", "r")) == NULL)
-		return 1;
+/*
+ * Mounts are probed by a small pool of worker threads, so a hung network
+ * filesystem can only stall its own probe.  A probe that misses its
+ * deadline leaves the mount stale with its last good values; the worker
+ * stays parked in statvfs() and a fresh one is started in its place.
+ */
+struct mount {
+	char		*dir;
+	char		*fstype;
+	char		*source;
+	int		 id;
+	dev_t		 dev;
+	uint64_t	 total;
+	uint64_t	 used;
+	long		 probe_us;
+	int		 valid;
+	int		 stale;
+	int		 busy;
+	int		 dead;	/* dropped from the table while busy */
+	int		 counted;
+};
 
-	while ((mnt = getmntent(mtab)) != NULL) {
-		statvfs(mnt->mnt_dir, &buf);
-		total +=  buf.f_blocks * buf.f_bsize;
-		used  += (buf.f_blocks - buf.f_bfree) * buf.f_bsize;
-	}
-	fclose(mtab);
+enum { PW_FREE, PW_IDLE, PW_BUSY };
 
-#elif defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+struct probe_worker {
+	int		 state;
+	int		 stuck;
+	struct timespec	 start;
+	struct mount	*job;
+};
 
-	int		 mntsize = 0;
-	int		 i;
+static pthread_mutex_t	 probe_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 probe_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	 probe_done;
+static struct probe_worker probe_workers[PROBE_MAXWORKERS];
+static struct mount	**probe_queue = NULL;
+static size_t		 probe_qhead, probe_qtail;
+static int		 probe_pending;
+static int		 probe_quit;
+static int64_t		 probe_cpu_ns;	/* spent in statvfs(), for the budget */
 
-#ifdef __NetBSD__
-	struct statvfs	*mntbuf;
-	mntsize = getmntinfo(&mntbuf, ST_WAIT);
-#else
-	struct statfs	*mntbuf;
-	mntsize = getmntinfo(&mntbuf, MNT_WAIT);
-#endif /* netbsd */
+/* Kept sorted by mount id, rebuilt only when the kernel reports a change. */
+static struct mount	**mounts = NULL;
+static size_t		 nmounts;
+static int		 mounts_fd = -1;
+static int		 mounts_dirty = 1;
+static struct t_hook	*mounts_hook = NULL;
 
-	for(i = 0; i < mntsize; i++) {
-		if (strncmp(mntbuf[i].f_mntfromname, "/dev/", 5) &&
-		    strncmp(mntbuf[i].f_mntfromname, "ROOT", 4))
-			continue;
+/*
+ * Pseudo and layered filesystems only distort the totals.  Both lists are
+ * comma separated; a leading '!' excludes, and a list with no plain entry
+ * lets through everything it does not exclude.
+ */
+#define DISK_FSTYPES \
+	"!autofs,!binfmt_misc,!bpf,!cgroup,!cgroup2,!configfs,!debugfs," \
+	"!devpts,!devtmpfs,!efivarfs,!fusectl,!hugetlbfs,!mqueue,!nsfs," \
+	"!overlay,!proc,!pstore,!ramfs,!rpc_pipefs,!securityfs,!squashfs," \
+	"!sysfs,!tmpfs,!tracefs"
+#define DISK_MOUNTS "*"
+
+static char		**disk_fstypes = NULL;
+static int		  disk_nfstypes;
+static char		**disk_mounts = NULL;
+static int		  disk_nmounts;
+
+static long
+ts_diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000L +
+	    (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static void
+ts_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec  += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void
+mount_free(struct mount *m)
+{
+	free(m);
+}
+
+/* Called with probe_mtx held. */
+static int
+probe_live(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < PROBE_MAXWORKERS; i++)
+		if (probe_workers[i].state != PW_FREE &&
+		    !probe_workers[i].stuck)
+			n++;
+	return n;
+}
+
+static void *
+probe_main(void *arg)
+{
+	struct probe_worker	*w = arg;
+	struct mount		*m;
+	struct statvfs		 buf;
+	struct timespec		 end;
+	int64_t			 cpu;
+	int			 rc;
+
+	pthread_mutex_lock(&probe_mtx);
+	for (;;) {
+		while (!probe_quit && probe_qhead == probe_qtail)
+			pthread_cond_wait(&probe_work, &probe_mtx);
+		if (probe_quit)
+			break;
+
+		m = probe_queue[probe_qhead++];
+		w->job = m;
+		w->state = PW_BUSY;
+		clock_gettime(CLOCK_MONOTONIC, &w->start);
+		pthread_mutex_unlock(&probe_mtx);
+
+		cpu = thread_cpu_ns();
+		rc = statvfs(m->dir, &buf);
+		cpu = thread_cpu_ns() - cpu;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		pthread_mutex_lock(&probe_mtx);
+		probe_cpu_ns += cpu;
+		m->probe_us = ts_diff_us(&w->start, &end);
+		if (rc == 0) {
+			m->total = (uint64_t)buf.f_blocks * buf.f_bsize;
+			m->used  = (uint64_t)(buf.f_blocks - buf.f_bfree) *
+			    buf.f_bsize;
+			m->valid = 1;
+		}
+		m->busy = 0;
+		if (m->dead)
+			mount_free(m);
+		w->job = NULL;
+		w->state = PW_IDLE;
+
+		if (!w->stuck) {
+			probe_pending--;
+			pthread_cond_signal(&probe_done);
+		} else {
+			/* Our replacement is already running. */
+			w->stuck = 0;
+			if (probe_live() > disk_workers)
+				break;
+		}
+	}
+	w->state = PW_FREE;
+	w->stuck = 0;
+	pthread_mutex_unlock(&probe_mtx);
+
+	return NULL;
+}
+
+/* Called with probe_mtx held. */
+static void
+probe_spawn(void)
+{
+	pthread_attr_t	attr;
+	pthread_t	tid;
+	int		i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < PROBE_MAXWORKERS && probe_live() < disk_workers; i++) {
+		if (probe_workers[i].state != PW_FREE)
+			continue;
+		probe_workers[i].state = PW_IDLE;
+		if (pthread_create(&tid, &attr, probe_main, &probe_workers[i])) {
+			probe_workers[i].state = PW_FREE;
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Probe every known mount and wait until each probe has either answered
+ * or run past its deadline.
+ */
+static void
+probe_mounts(void)
+{
+	struct probe_worker	*w;
+	struct timespec		 now, wake, dl;
+	size_t			 i;
+
+	pthread_mutex_lock(&probe_mtx);
+	probe_qhead = probe_qtail = 0;
+	for (i = 0; i < nmounts; i++) {
+		if (!mounts[i]->counted)
+			continue;
+		if (mounts[i]->busy) {
+			mounts[i]->stale = 1;
+			continue;
+		}
+		mounts[i]->busy = 1;
+		mounts[i]->stale = 0;
+		probe_queue[probe_qtail++] = mounts[i];
+		probe_pending++;
+	}
+	pthread_cond_broadcast(&probe_work);
+
+	while (probe_pending > 0) {
+		probe_spawn();
+		if (probe_live() == 0) {
+			/* Out of threads: give up on what is still queued. */
+			for (; probe_qhead < probe_qtail; probe_qhead++) {
+				probe_queue[probe_qhead]->busy = 0;
+				probe_queue[probe_qhead]->stale = 1;
+				probe_pending--;
+			}
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wake = now;
+		ts_add_ms(&wake, disk_timeout);
+		for (i = 0; i < PROBE_MAXWORKERS; i++) {
+			w = &probe_workers[i];
+			if (w->state != PW_BUSY || w->stuck)
+				continue;
+			dl = w->start;
+			ts_add_ms(&dl, disk_timeout);
+			if (ts_diff_us(&now, &dl) <= 0) {
+				w->stuck = 1;
+				w->job->stale = 1;
+				probe_pending--;
+			} else if (ts_diff_us(&dl, &wake) > 0)
+				wake = dl;
+		}
+		if (probe_pending > 0)
+			pthread_cond_timedwait(&probe_done, &probe_mtx, &wake);
+	}
+	pthread_mutex_unlock(&probe_mtx);
+}
+
+/*
+ * Undo the octal escapes (\040 and friends) the kernel puts in paths.
+ */
+static void
+mountinfo_unescape(char *s)
+{
+	char *d = s;
+
+	for (; *s; s++, d++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+			s += 3;
+		} else
+			*d = *s;
+	}
+	*d = '\0';
+}
+
+/*
+ * Parse one /proc/self/mountinfo line:
+ *   id parent major:minor root mountpoint options [optional...] - fstype source superopts
+ */
+static struct mount *
+mountinfo_parse(char *line)
+{
+	struct mount	*m;
+	char		*f[6], *fstype = NULL, *source = NULL, *tok, *last;
+	unsigned int	 major, minor;
+	size_t		 n = 0, dlen, tlen, slen;
+
+	for (tok = strtok_r(line, " \n", &last); tok != NULL;
+	    tok = strtok_r(NULL, " \n", &last)) {
+		if (n < 6)
+			f[n++] = tok;
+		else if (!strcmp(tok, "-")) {
+			fstype = strtok_r(NULL, " \n", &last);
+			source = strtok_r(NULL, " \n", &last);
+			break;
+		}
+	}
+	if (n < 6 || fstype == NULL || source == NULL ||
+	    sscanf(f[2], "%u:%u", &major, &minor) != 2)
+		return NULL;
+	mountinfo_unescape(f[4]);
+
+	dlen = strlen(f[4]) + 1;
+	tlen = strlen(fstype) + 1;
+	slen = strlen(source) + 1;
+	if ((m = calloc(1, sizeof(*m) + dlen + tlen + slen)) == NULL)
+		return NULL;
+	m->dir = (char *)(m + 1);
+	m->fstype = m->dir + dlen;
+	m->source = m->fstype + tlen;
+	memcpy(m->dir, f[4], dlen);
+	memcpy(m->fstype, fstype, tlen);
+	memcpy(m->source, source, slen);
+	m->id = atoi(f[0]);
+	m->dev = makedev(major, minor);
+
+	return m;
+}
+
+static int
+mount_cmp(const void *a, const void *b)
+{
+	const struct mount *ma = *(struct mount * const *)a;
+	const struct mount *mb = *(struct mount * const *)b;
+
+	return (ma->id > mb->id) - (ma->id < mb->id);
+}
+
+static int
+mount_devcmp(const void *a, const void *b)
+{
+	const struct mount *ma = *(struct mount * const *)a;
+	const struct mount *mb = *(struct mount * const *)b;
+
+	if (ma->dev != mb->dev)
+		return (ma->dev > mb->dev) - (ma->dev < mb->dev);
+	return mount_cmp(a, b);
+}
+
+/*
+ * Split a comma separated list into a single allocation, for the
+ * sampler thread, which has no business calling into WeeChat.
+ */
+static char **
+list_split(const char *s, int *n)
+{
+	char	**v, *p, *tok, *last;
+	size_t	  len = strlen(s), k = 1, i;
+
+	*n = 0;
+	for (i = 0; i < len; i++)
+		if (s[i] == ',')
+			k++;
+	if ((v = malloc((k + 1) * sizeof(*v) + len + 1)) == NULL)
+		return NULL;
+	p = memcpy(v + k + 1, s, len + 1);
+	for (tok = strtok_r(p, ",", &last); tok != NULL;
+	    tok = strtok_r(NULL, ",", &last))
+		v[(*n)++] = tok;
+	v[*n] = NULL;
+
+	return v;
+}
+
+static int
+filter_match(char **list, int n, const char *s, int glob)
+{
+	const char	*pat;
+	int		 i, neg, match, ok = 1;
+
+	for (i = 0; i < n; i++)
+		if (list[i][0] != '!')
+			ok = 0;
+	for (i = 0; i < n; i++) {
+		neg = list[i][0] == '!';
+		pat = list[i] + neg;
+		match = glob ? !fnmatch(pat, s, 0) : !strcmp(pat, s);
+		if (match && neg)
+			return 0;
+		if (match)
+			ok = 1;
+	}
+	return ok;
+}
+
+/*
+ * Decide which mounts are worth a statvfs(), without making one: the
+ * fstype and mountpoint filters first, then one mount per st_dev so a
+ * bind mount is not counted twice.  Called with probe_mtx held.
+ */
+static void
+mounts_filter(void)
+{
+	struct mount	**tab;
+	size_t		  i, n = 0;
+
+	for (i = 0; i < nmounts; i++)
+		mounts[i]->counted =
+		    filter_match(disk_fstypes, disk_nfstypes,
+			mounts[i]->fstype, 0) &&
+		    filter_match(disk_mounts, disk_nmounts,
+			mounts[i]->dir, 1);
+
+	if ((tab = malloc((nmounts ? nmounts : 1) * sizeof(*tab))) == NULL)
+		return;
+	for (i = 0; i < nmounts; i++)
+		if (mounts[i]->counted)
+			tab[n++] = mounts[i];
+	qsort(tab, n, sizeof(*tab), mount_devcmp);
+	for (i = 1; i < n; i++)
+		if (tab[i]->dev == tab[i - 1]->dev)
+			tab[i]->counted = 0;
+	free(tab);
+}
+
+/*
+ * Re-read /proc/self/mountinfo.  Mounts we already know keep their entry,
+ * and with it their last values and any probe still in flight.
+ */
+static int
+mounts_rebuild(void)
+{
+	FILE		 *fp;
+	struct mount	**tab = NULL, **p, *m;
+	char		 *line = NULL, path[2 * BSIZE];
+	size_t		  cap = 0, n = 0, size = 0, i, j;
+
+	if ((fp = fopen(mtab_path[0] ? mtab_path : root_path(path,
+	    sizeof(path), proc_root, "/self/mountinfo"), "r")) == NULL)
+		return 1;
+	while (getline(&line, &cap, fp) != -1) {
+		if ((m = mountinfo_parse(line)) == NULL)
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			if ((p = realloc(tab, size * sizeof(*p))) == NULL) {
+				mount_free(m);
+				break;
+			}
+			tab = p;
+		}
+		tab[n++] = m;
+	}
+	free(line);
+	fclose(fp);
+	qsort(tab, n, sizeof(*tab), mount_cmp);
+
+	pthread_mutex_lock(&probe_mtx);
+	if ((p = realloc(probe_queue, (n ? n : 1) * sizeof(*p))) == NULL) {
+		pthread_mutex_unlock(&probe_mtx);
+		for (i = 0; i < n; i++)
+			mount_free(tab[i]);
+		free(tab);
+		return 1;
+	}
+	probe_queue = p;
+
+	for (i = j = 0; i < n; i++) {
+		while (j < nmounts && mounts[j]->id < tab[i]->id) {
+			if (mounts[j]->busy)
+				mounts[j]->dead = 1;
+			else
+				mount_free(mounts[j]);
+			j++;
+		}
+		if (j < nmounts && mounts[j]->id == tab[i]->id &&
+		    !strcmp(mounts[j]->dir, tab[i]->dir)) {
+			mount_free(tab[i]);
+			tab[i] = mounts[j++];
+		}
+	}
+	for (; j < nmounts; j++) {
+		if (mounts[j]->busy)
+			mounts[j]->dead = 1;
+		else
+			mount_free(mounts[j]);
+	}
+	free(mounts);
+	mounts = tab;
+	nmounts = n;
+	mounts_filter();
+	pthread_mutex_unlock(&probe_mtx);
+
+	return 0;
+}
+
+/*
+ * The kernel flags /proc/self/mounts with POLLPRI whenever the mount table
+ * of our namespace changes; the next disk query picks it up.
+ */
+static int
+mounts_changed_cb(void *data, int fd)
+{
+	__atomic_store_n(&mounts_dirty, 1, __ATOMIC_RELAXED);
+	return WEECHAT_RC_OK;
+}
+
+static void
+mounts_print(struct t_gui_buffer *buffer, char **argv, int argc)
+{
+	struct mount	*m;
+	size_t		 i;
+
+	pthread_mutex_lock(&probe_mtx);
+	for (i = 0; i < nmounts; i++) {
+		m = mounts[i];
+		if (!m->counted)
+			continue;
+		weechat_printf(buffer, "%s: %.2fGB/%.2fGB, probe %ld.%03ldms%s",
+		    m->dir,
+		    (float)m->used / (1 << 30),
+		    (float)m->total / (1 << 30),
+		    m->probe_us / 1000, m->probe_us % 1000,
+		    m->stale ? " (stale)" : "");
+	}
+	pthread_mutex_unlock(&probe_mtx);
+}
+
+static void
+probe_init(void)
+{
+	pthread_condattr_t	attr;
+	char			path[2 * BSIZE];
+	int			i;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&probe_done, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/*
+	 * If a hung probe kept us loaded, this is the same image again:
+	 * workers still in statvfs() stay stuck, their mounts busy, and the
+	 * rest starts over with the table re-read.
+	 */
+	pthread_mutex_lock(&probe_mtx);
+	probe_quit = 0;
+	probe_qhead = probe_qtail = 0;
+	probe_pending = 0;
+	for (i = 0; i < PROBE_MAXWORKERS; i++)
+		if (probe_workers[i].state != PW_FREE)
+			probe_workers[i].stuck = 1;
+	pthread_mutex_unlock(&probe_mtx);
+	mounts_dirty = 1;
+
+	if ((mounts_fd = open(root_path(path, sizeof(path), proc_root,
+	    "/self/mounts"), O_RDONLY)) != -1)
+		mounts_hook = weechat_hook_fd(mounts_fd, 0, 0, 1,
+		    &mounts_changed_cb, NULL);
+}
+
+/*
+ * Idle workers go away on their own.  A worker still parked in a hung
+ * statvfs() would come back into unmapped code, so in that case we keep
+ * ourselves loaded for good.
+ */
+static void
+probe_end(void)
+{
+	struct timespec	 ts = { 0, 10 * 1000000L };
+	Dl_info		 dli;
+	size_t		 i;
+	int		 busy = 0, tries;
+
+	if (mounts_hook) {
+		weechat_unhook(mounts_hook);
+		mounts_hook = NULL;
+	}
+	if (mounts_fd != -1) {
+		close(mounts_fd);
+		mounts_fd = -1;
+	}
+
+	pthread_mutex_lock(&probe_mtx);
+	probe_quit = 1;
+	pthread_cond_broadcast(&probe_work);
+	pthread_mutex_unlock(&probe_mtx);
+
+	for (tries = 0; tries < 100; tries++) {
+		pthread_mutex_lock(&probe_mtx);
+		for (i = 0, busy = 0; i < PROBE_MAXWORKERS; i++)
+			if (probe_workers[i].state != PW_FREE)
+				busy++;
+		pthread_mutex_unlock(&probe_mtx);
+		if (!busy)
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	if (busy) {
+		if (dladdr((void *)probe_main, &dli) && dli.dli_fname)
+			dlopen(dli.dli_fname, RTLD_NOW | RTLD_NODELETE);
+		return;
+	}
+
+	for (i = 0; i < nmounts; i++)
+		mount_free(mounts[i]);
+	free(mounts);
+	free(probe_queue);
+	mounts = probe_queue = NULL;
+	nmounts = 0;
+
+	free(disk_fstypes);
+	free(disk_mounts);
+	disk_fstypes = disk_mounts = NULL;
+	disk_nfstypes = disk_nmounts = 0;
+}
+
+#endif /* __linux__ */
+
+static int
+disk_info(weenfo *info)
+{
+	uint64_t total = 0,
+		 used  = 0;
+	int	 nstale = 0;
+#ifdef __linux__
+	size_t	 i;
+
+	if (__atomic_exchange_n(&mounts_dirty, 0, __ATOMIC_RELAXED) ||
+	    mounts_hook == NULL) {
+		if (mounts_rebuild()) {
+			mounts_dirty = 1;
+			return 1;
+		}
+	}
+	probe_mounts();
+
+	pthread_mutex_lock(&probe_mtx);
+	for (i = 0; i < nmounts; i++) {
+		if (!mounts[i]->counted)
+			continue;
+		if (mounts[i]->stale)
+			nstale++;
+		if (!mounts[i]->valid)
+			continue;
+		total += mounts[i]->total;
+		used  += mounts[i]->used;
+	}
+	pthread_mutex_unlock(&probe_mtx);
+
+#elif defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+
+	int		 mntsize = 0;
+	int		 i;
+
+#ifdef __NetBSD__
+	struct statvfs	*mntbuf;
+	mntsize = getmntinfo(&mntbuf, ST_WAIT);
+#else
+	struct statfs	*mntbuf;
+	mntsize = getmntinfo(&mntbuf, MNT_WAIT);
+#endif /* netbsd */
+
+	for(i = 0; i < mntsize; i++) {
+		if (strncmp(mntbuf[i].f_mntfromname, "/dev/", 5) &&
+		    strncmp(mntbuf[i].f_mntfromname, "ROOT", 4))
+			continue;
+
+		total += mntbuf[i].f_blocks * mntbuf[i].f_bsize;
+		used  += mntbuf[i].f_bfree * mntbuf[i].f_bsize;
+	}
+	used = total - used;
+#endif
+
+	info->disk_total_kb = total >> 10;
+	info->disk_used_kb = used >> 10;
+	info->disk_stale = nstale;
+	if (nstale)
+		snprintf(info->disk, sizeof(info->disk),
+		    "Disk Usage: %.2fGB/%.2fGB (%d stale)",
+		    (float)used / (1 << 30),
+		    (float)total / (1 << 30), nstale);
+	else
+		snprintf(info->disk, sizeof(info->disk),
+		    "Disk Usage: %.2fGB/%.2fGB",
+		    (float)used / (1 << 30),
+		    (float)total / (1 << 30));
+
+	return 0;
+}
+
+#define FIELD(f) offsetof(weenfo, f)
+
+static void
+add_to_line(struct line_t *line, char *p)
+{
+	int	 i;
+	char	*lp = line->str + line->len;
+
+	if (line->len && 3 < LINESIZE - line->len) {
+		*lp++ = ' ';
+		*lp++ = '-';
+		*lp++ = ' ';
+		line->len += 3;
+	}
+
+	for (i = 0; *p && i < LINESIZE - line->len; i++) {
+		*lp++ = *p++;
+	}
+	line->len += i;
+}
+
+static void
+collector_format(const struct collector *c, const weenfo *info,
+    struct line_t *line)
+{
+	add_to_line(line, (char *)info + c->field);
+}
+
+/* In the order "all" shows them. */
+static struct collector collectors[] = {
+	{ "uname",	"os",	uname_info,	collector_format,
+	    FIELD(uname),	3600,	C_ALL,	2 },
+	{ "cpu",	NULL,	cpu_info,	collector_format,
+	    FIELD(cpu),		10,	C_ALL,	2 },
+	{ "uptime",	NULL,	uptime_info,	collector_format,
+	    FIELD(uptime),	30,	C_ALL,	2 },
+	{ "load",	NULL,	load_info,	collector_format,
+	    FIELD(load),	5,	C_ALL,	0 },
+	{ "mem",	NULL,	mem_info,	collector_format,
+	    FIELD(mem),		10,	C_ALL,	0 },
+	{ "disk",	NULL,	disk_info,	collector_format,
+	    FIELD(disk),	300,	C_ALL | C_SLOW,	1 },
+	{ "cpuload",	NULL,	cpuload_info,	collector_format,
+	    FIELD(cpuload),	5,	0,	0 },
+};
+
+#define NCOLLECTORS (sizeof(collectors) / sizeof(collectors[0]))
+
+/*
+ * Collectors due on the same tick run side by side on a few persistent
+ * threads, with the main thread taking its share, so a tick costs about
+ * as much as its slowest collector.  Each one only writes its own part
+ * of the snapshot; the history and anything WeeChat stay on the main
+ * thread.
+ */
+#define RUN_MAXWORKERS 16
+
+static pthread_t	 run_threads[RUN_MAXWORKERS];
+static int		 run_nthreads;
+static int		 run_workers = 3;
+static pthread_mutex_t	 run_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 run_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	 run_done = PTHREAD_COND_INITIALIZER;
+static struct collector	*run_batch[NCOLLECTORS];
+static int		 run_rc[NCOLLECTORS];
+static size_t		 run_n, run_next, run_left;
+static int		 run_quit;
+static int64_t		 run_cpu_ns;	/* spent on the workers */
+
+/*
+ * Latency histogram: bucket b counts the times in [2^(b-1), 2^b) ns.
+ */
+#define LAT_BUCKETS	40
+
+struct lat {
+	uint64_t	n;
+	uint64_t	max;		/* ns */
+	uint32_t	b[LAT_BUCKETS];
+};
+
+/*
+ * The sampler thread collects into sample_work and publishes it into
+ * one of two slots, each with a sequence count that is odd while the
+ * slot is written.  The main thread is woken through sample_fd, copies
+ * the newest slot and retries if its count moved, so it only ever sees
+ * whole samples and neither side waits for the other.  The per-core
+ * loads go along in cpu_slot, inside the same count.  Settings travel
+ * the other way the same way, through conf_slot; sampler_mtx only wakes
+ * the sampler thread up, and is never held while collecting.
+ */
+struct sample {
+	weenfo		w;
+	struct timeval	last[NCOLLECTORS];
+	uint64_t	runs[NCOLLECTORS];
+	int64_t		cost_us[NCOLLECTORS];
+	int64_t		cur[NCOLLECTORS];
+	int64_t		cpu_ns;		/* sampler CPU time a second */
+	int64_t		shed;		/* budget level */
+	struct lat	lat[NCOLLECTORS];	/* collecting */
+	uint64_t	lat_gen;	/* the reset lat is counted since */
+};
+
+static struct sample	 sample_work;
+static struct sample	 sample_seen;	/* the main thread's copy */
+static struct sample	 sample_slot[2];
+static unsigned		 sample_seq[2];
+static int		 sample_latest;
+static int		 sample_fd[2] = { -1, -1 };
+static uint64_t		 lat_gen;	/* bumped by /esys stats reset */
+static struct lat	 lat_show[NCOLLECTORS];	/* formatting, main only */
+static struct t_hook	*sample_hook = NULL;
+
+static int		 adaptive = 1;
+static int		 adaptive_threshold = 10;	/* percent */
+
+/*
+ * The sampler keeps to a CPU budget, in percent of one core, counting its
+ * own thread, the time its collectors take on the workers and the disk
+ * probes' statvfs() calls.  Unused budget builds up to a minute's worth
+ * of credit; once that is gone, collectors start to wait, those with
+ * shed 1 first, then shed 2 if that was not enough, and come back as the
+ * credit recovers.
+ */
+#define SHED_MAX	2
+#define BUDGET_BURST	60		/* seconds of credit */
+
+static double		 budget = 0.1;
+static int64_t		 budget_credit;	/* ns of CPU time in hand */
+static int64_t		 budget_prev;	/* the sampler's own CPU time */
+static int64_t		 budget_avg;	/* ns a second */
+static int		 budget_level;
+
+static pthread_t	 sampler_thread;
+static uint64_t		 sampler_tick;	/* seconds since it started */
+static int		 sampler_running, sampler_quit;
+static pthread_mutex_t	 sampler_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 sampler_wake;
+
+/*
+ * What the sampler works from, filled in by config_read on the main
+ * thread, which keeps conf_slot for itself and bumps conf_seq around
+ * each copy into it.  The sampler takes it at the start of a tick and
+ * leaves it for the next one if a copy is under way.
+ */
+#define CONF_LISTSIZE	1024
+
+struct sampler_conf {
+	int	interval[NCOLLECTORS];
+	int	imin[NCOLLECTORS];
+	int	imax[NCOLLECTORS];
+	int	adaptive;
+	int	adaptive_threshold;
+	double	budget;
+	int	disk_timeout;
+	int	disk_workers;
+	int	run_workers;
+	int	cpuload_top;
+	char	disk_fstypes[CONF_LISTSIZE];
+	char	disk_mounts[CONF_LISTSIZE];
+};
+
+static struct sampler_conf	 conf_slot;
+static unsigned			 conf_seq;
+static unsigned			 conf_taken;	/* by the sampler */
+
+/*
+ * Every raw value is also an info, read straight from the snapshot.
+ */
+enum { INFO_STR, INFO_U64, INFO_DOUBLE };
+
+struct info {
+	const char	*name;
+	const char	*desc;
+	int		 type;
+	size_t		 off;
+	const char	*collector;	/* the one that samples it */
+	struct ring	 hist;
+	struct series	 store;
+	struct tier	 tiers[NTIERS];
+};
+
+static struct info infos[] = {
+	{ "sysinfo_os_name",	"operating system name",
+	    INFO_STR,		FIELD(os_name), "uname" },
+	{ "sysinfo_os_release",	"operating system release",
+	    INFO_STR,		FIELD(os_release), "uname" },
+	{ "sysinfo_os_machine",	"hardware type",
+	    INFO_STR,		FIELD(os_machine), "uname" },
+	{ "sysinfo_cpu_model",	"CPU model",
+	    INFO_STR,		FIELD(cpu_model), "cpu" },
+	{ "sysinfo_cpu_mhz",	"average CPU clock (MHz)",
+	    INFO_DOUBLE,	FIELD(cpu_mhz), "cpu" },
+	{ "sysinfo_cpu_mhz_min", "lowest core clock (MHz)",
+	    INFO_DOUBLE,	FIELD(cpu_mhz_min), "cpu" },
+	{ "sysinfo_cpu_mhz_max", "highest core clock (MHz)",
+	    INFO_DOUBLE,	FIELD(cpu_mhz_max), "cpu" },
+	{ "sysinfo_cpu_usage",	"CPU utilisation (%)",
+	    INFO_DOUBLE,	FIELD(cpu_busy), "cpuload" },
+	{ "sysinfo_cpu_user",	"CPU time in user mode (%)",
+	    INFO_DOUBLE,	FIELD(cpu_user), "cpuload" },
+	{ "sysinfo_cpu_system",	"CPU time in kernel mode (%)",
+	    INFO_DOUBLE,	FIELD(cpu_system), "cpuload" },
+	{ "sysinfo_cpu_iowait",	"CPU time waiting for I/O (%)",
+	    INFO_DOUBLE,	FIELD(cpu_iowait), "cpuload" },
+	{ "sysinfo_cpu_steal",	"CPU time stolen by the hypervisor (%)",
+	    INFO_DOUBLE,	FIELD(cpu_steal), "cpuload" },
+	{ "sysinfo_uptime",	"uptime (seconds)",
+	    INFO_U64,		FIELD(uptime_sec), "uptime" },
+	{ "sysinfo_load1",	"1 minute load average",
+	    INFO_DOUBLE,	FIELD(loadavg[0]), "load" },
+	{ "sysinfo_load5",	"5 minute load average",
+	    INFO_DOUBLE,	FIELD(loadavg[1]), "load" },
+	{ "sysinfo_load15",	"15 minute load average",
+	    INFO_DOUBLE,	FIELD(loadavg[2]), "load" },
+	{ "sysinfo_mem_total_kb", "total memory (KB)",
+	    INFO_U64,		FIELD(mem_total_kb), "mem" },
+	{ "sysinfo_mem_used_kb", "used memory (KB)",
+	    INFO_U64,		FIELD(mem_used_kb), "mem" },
+	{ "sysinfo_disk_total_kb", "total disk space (KB)",
+	    INFO_U64,		FIELD(disk_total_kb), "disk" },
+	{ "sysinfo_disk_used_kb", "used disk space (KB)",
+	    INFO_U64,		FIELD(disk_used_kb), "disk" },
+	{ "sysinfo_disk_stale",	"mounts that did not answer in time",
+	    INFO_U64,		FIELD(disk_stale), "disk" },
+};
+
+#define NINFOS (sizeof(infos) / sizeof(infos[0]))
+
+static const struct {
+	const char	*alias;
+	const char	*name;
+} metric_aliases[] = {
+	{ "cpu",	"sysinfo_cpu_usage" },
+	{ "mem",	"sysinfo_mem_used_kb" },
+	{ "load",	"sysinfo_load1" },
+	{ "disk",	"sysinfo_disk_used_kb" },
+};
+
+static int
+ring_resize(struct ring *r, size_t size)
+{
+	time_t	*t;
+	double	*v;
+	size_t	 i, n, from;
+
+	if ((t = malloc(size * sizeof(*t))) == NULL)
+		return 1;
+	if ((v = malloc(size * sizeof(*v))) == NULL) {
+		free(t);
+		return 1;
+	}
+	/* Carry over the newest samples, oldest first. */
+	n = r->count < size ? r->count : size;
+	from = (r->head + r->size - n) % (r->size ? r->size : 1);
+	for (i = 0; i < n; i++) {
+		t[i] = r->t[(from + i) % r->size];
+		v[i] = r->v[(from + i) % r->size];
+	}
+	free(r->t);
+	free(r->v);
+	r->t = t;
+	r->v = v;
+	r->size = size;
+	r->count = n;
+	r->head = n % size;
+
+	return 0;
+}
+
+static void
+ring_free(struct ring *r)
+{
+	free(r->t);
+	free(r->v);
+	memset(r, 0, sizeof(*r));
+}
+
+static void
+ring_append(struct ring *r, time_t t, double v)
+{
+	if (r->size == 0)
+		return;
+	r->t[r->head] = t;
+	r->v[r->head] = v;
+	r->head = (r->head + 1) % r->size;
+	if (r->count < r->size)
+		r->count++;
+}
+
+struct aggr {
+	double	min, max, sum, last;
+	size_t	n;
+};
+
+/*
+ * Fold every sample taken at or after since, newest first.
+ */
+static void
+ring_aggregate(const struct ring *r, time_t since, struct aggr *a)
+{
+	size_t	i, k;
+	double	v;
+
+	memset(a, 0, sizeof(*a));
+	for (k = 0; k < r->count; k++) {
+		i = (r->head + r->size - 1 - k) % r->size;
+		if (r->t[i] < since)
+			break;
+		v = r->v[i];
+		if (a->n == 0) {
+			a->min = a->max = a->last = v;
+		} else {
+			if (v < a->min)
+				a->min = v;
+			if (v > a->max)
+				a->max = v;
+		}
+		a->sum += v;
+		a->n++;
+	}
+}
+
+struct bitbuf {
+	uint8_t	*p;
+	size_t	 pos;	/* in bits */
+};
+
+/* The buffer must be zeroed; bits go in most significant first. */
+static void
+bits_put(struct bitbuf *b, uint64_t v, int n)
+{
+	int room, k;
+
+	while (n > 0) {
+		room = 8 - (b->pos & 7);
+		k = n < room ? n : room;
+		b->p[b->pos >> 3] |=
+		    ((v >> (n - k)) & ((1U << k) - 1)) << (room - k);
+		b->pos += k;
+		n -= k;
+	}
+}
+
+static uint64_t
+bits_get(struct bitbuf *b, int n)
+{
+	uint64_t	v = 0;
+	int		room, k;
+
+	while (n > 0) {
+		room = 8 - (b->pos & 7);
+		k = n < room ? n : room;
+		v = (v << k) |
+		    ((b->p[b->pos >> 3] >> (room - k)) & ((1U << k) - 1));
+		b->pos += k;
+		n -= k;
+	}
+
+	return v;
+}
+
+static int64_t
+sign_extend(uint64_t v, int bits)
+{
+	return (int64_t)(v << (64 - bits)) >> (64 - bits);
+}
+
+static int
+block_seal(struct block *blk, const time_t *t, const double *v, int n)
+{
+	struct bitbuf	 b;
+	uint64_t	 prev, cur, x;
+	int64_t		 delta, pdelta = 0, dod;
+	uint8_t		*p;
+	int		 i, lead, trail, plead = -1, ptrail = 0, sig;
+
+	/* Worst case per sample: 4 + 64 bits of time, 2 + 5 + 6 + 64 of value. */
+	if ((b.p = calloc(16 + (size_t)n * 19, 1)) == NULL)
+		return 1;
+	b.pos = 0;
+
+	memcpy(&prev, &v[0], sizeof(prev));
+	bits_put(&b, (uint64_t)t[0], 64);
+	bits_put(&b, prev, 64);
+	for (i = 1; i < n; i++) {
+		delta = t[i] - t[i - 1];
+		dod = delta - pdelta;
+		pdelta = delta;
+		if (dod == 0)
+			bits_put(&b, 0, 1);
+		else if (dod >= -64 && dod < 64) {
+			bits_put(&b, 2, 2);
+			bits_put(&b, dod, 7);
+		} else if (dod >= -256 && dod < 256) {
+			bits_put(&b, 6, 3);
+			bits_put(&b, dod, 9);
+		} else if (dod >= -2048 && dod < 2048) {
+			bits_put(&b, 14, 4);
+			bits_put(&b, dod, 12);
+		} else {
+			bits_put(&b, 15, 4);
+			bits_put(&b, dod, 64);
+		}
+
+		memcpy(&cur, &v[i], sizeof(cur));
+		x = cur ^ prev;
+		prev = cur;
+		if (x == 0) {
+			bits_put(&b, 0, 1);
+			continue;
+		}
+		lead = __builtin_clzll(x);
+		trail = __builtin_ctzll(x);
+		if (lead > 31)
+			lead = 31;
+		if (plead >= 0 && lead >= plead && trail >= ptrail) {
+			bits_put(&b, 2, 2);
+			bits_put(&b, x >> ptrail, 64 - plead - ptrail);
+		} else {
+			sig = 64 - lead - trail;
+			bits_put(&b, 3, 2);
+			bits_put(&b, lead, 5);
+			bits_put(&b, sig - 1, 6);
+			bits_put(&b, x >> trail, sig);
+			plead = lead;
+			ptrail = trail;
+		}
+	}
+
+	blk->t0 = t[0];
+	blk->t1 = t[n - 1];
+	blk->n = n;
+	blk->len = (b.pos + 7) >> 3;
+	blk->data = (p = realloc(b.p, blk->len)) ? p : b.p;
+
+	return 0;
+}
+
+static void
+aggr_add(struct aggr *a, double v)
+{
+	if (a->n == 0)
+		a->min = a->max = v;
+	if (v < a->min)
+		a->min = v;
+	if (v > a->max)
+		a->max = v;
+	a->sum += v;
+	a->last = v;
+	a->n++;
+}
+
+/*
+ * Decode a sealed block, folding the samples taken at or after since.
+ */
+static void
+block_aggregate(const struct block *blk, time_t since, struct aggr *a)
+{
+	struct bitbuf	b;
+	uint64_t	val, x;
+	int64_t		t, delta = 0;
+	double		d;
+	int		i, lead = 0, sig = 0, trail = 0;
+
+	b.p = blk->data;
+	b.pos = 0;
+	t = (int64_t)bits_get(&b, 64);
+	val = bits_get(&b, 64);
+	for (i = 0; ; ) {
+		if (t >= since) {
+			memcpy(&d, &val, sizeof(d));
+			aggr_add(a, d);
+		}
+		if (++i == (int)blk->n)
+			break;
+
+		if (bits_get(&b, 1) == 0)
+			;
+		else if (bits_get(&b, 1) == 0)
+			delta += sign_extend(bits_get(&b, 7), 7);
+		else if (bits_get(&b, 1) == 0)
+			delta += sign_extend(bits_get(&b, 9), 9);
+		else if (bits_get(&b, 1) == 0)
+			delta += sign_extend(bits_get(&b, 12), 12);
+		else
+			delta += (int64_t)bits_get(&b, 64);
+		t += delta;
+
+		if (bits_get(&b, 1) == 0)
+			continue;
+		if (bits_get(&b, 1) == 1) {
+			lead = bits_get(&b, 5);
+			sig = bits_get(&b, 6) + 1;
+			trail = 64 - lead - sig;
+		}
+		x = bits_get(&b, sig) << trail;
+		val ^= x;
+	}
+}
+
+static void
+series_prune(struct series *s, time_t now)
+{
+	size_t i;
+
+	while (s->first < s->nblocks &&
+	    s->blocks[s->first].t1 < now - history_retention)
+		free(s->blocks[s->first++].data);
+
+	/* Compact once the dropped blocks take up half the array. */
+	if (s->first > 0 && s->first * 2 >= s->nblocks) {
+		for (i = s->first; i < s->nblocks; i++)
+			s->blocks[i - s->first] = s->blocks[i];
+		s->nblocks -= s->first;
+		s->first = 0;
+	}
+}
+
+static void
+series_append(struct series *s, time_t t, double v)
+{
+	struct block	*p;
+	size_t		 size;
+
+	s->ht[s->hn] = t;
+	s->hv[s->hn] = v;
+	if (++s->hn < SERIES_BLOCK)
+		return;
+
+	s->hn = 0;
+	if (s->nblocks == s->blocks_size) {
+		size = s->blocks_size ? s->blocks_size * 2 : 16;
+		if ((p = realloc(s->blocks, size * sizeof(*p))) == NULL)
+			return;
+		s->blocks = p;
+		s->blocks_size = size;
+	}
+	if (block_seal(&s->blocks[s->nblocks], s->ht, s->hv,
+	    SERIES_BLOCK) == 0)
+		s->nblocks++;
+	series_prune(s, t);
+}
+
+static void
+series_aggregate(const struct series *s, time_t since, struct aggr *a)
+{
+	size_t	lo = s->first, hi = s->nblocks, mid;
+	int	i;
+
+	memset(a, 0, sizeof(*a));
+
+	/* First block that ends inside the window. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s->blocks[mid].t1 < since)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < s->nblocks; lo++)
+		block_aggregate(&s->blocks[lo], since, a);
+	for (i = 0; i < s->hn; i++)
+		if (s->ht[i] >= since)
+			aggr_add(a, s->hv[i]);
+}
+
+static void
+series_free(struct series *s)
+{
+	size_t i;
+
+	for (i = s->first; i < s->nblocks; i++)
+		free(s->blocks[i].data);
+	free(s->blocks);
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * What a store takes, for history stats.  Only the sealed blocks are
+ * compressed; the open block and the block index cost the same however
+ * many samples there are.
+ */
+struct series_usage {
+	size_t	sealed;		/* bytes of sealed block data */
+	size_t	nsealed;	/* samples in them */
+	size_t	nopen;		/* samples in the open block */
+	size_t	fixed;		/* open block and block index, in bytes */
+};
+
+static void
+series_usage(const struct series *s, struct series_usage *u)
+{
+	size_t	i;
+
+	u->fixed += sizeof(*s) + s->blocks_size * sizeof(struct block);
+	u->nopen += s->hn;
+	for (i = s->first; i < s->nblocks; i++) {
+		u->sealed += s->blocks[i].len;
+		u->nsealed += s->blocks[i].n;
+	}
+}
+
+static int
+tier_resize(struct tier *tr, size_t size)
+{
+	struct bucket	*b;
+	size_t		 i, n, from;
+
+	if (size == tr->size)
+		return 0;
+	if ((b = malloc(size * sizeof(*b))) == NULL)
+		return 1;
+	/* Carry over the newest buckets, oldest first. */
+	n = tr->count < size ? tr->count : size;
+	from = (tr->head + 1 + tr->size - n) % (tr->size ? tr->size : 1);
+	for (i = 0; i < n; i++)
+		b[i] = tr->b[(from + i) % tr->size];
+	free(tr->b);
+	tr->b = b;
+	tr->size = size;
+	tr->count = n;
+	tr->head = n ? n - 1 : 0;
+
+	return 0;
+}
+
+static void
+tier_add(struct tier *tr, long step, time_t t, double v)
+{
+	struct bucket	*b;
+	time_t		 start = t - t % step;
+
+	if (tr->size == 0)
+		return;
+	b = &tr->b[tr->head];
+	/* A clock going backwards lands in the open bucket. */
+	if (tr->count == 0 || start > b->t) {
+		if (tr->count)
+			tr->head = (tr->head + 1) % tr->size;
+		if (tr->count < tr->size)
+			tr->count++;
+		b = &tr->b[tr->head];
+		b->t = start;
+		b->min = b->max = b->sum = v;
+		b->n = 1;
+		return;
+	}
+	if (v < b->min)
+		b->min = v;
+	if (v > b->max)
+		b->max = v;
+	b->sum += v;
+	b->n++;
+}
+
+/*
+ * Fold every bucket that overlaps the window, newest first.  Buckets
+ * carry no last value; the caller fills it in.
+ */
+static void
+tier_aggregate(const struct tier *tr, long step, time_t since,
+    struct aggr *a)
+{
+	const struct bucket	*b;
+	size_t			 i, k;
+
+	memset(a, 0, sizeof(*a));
+	for (k = 0; k < tr->count; k++) {
+		i = (tr->head + tr->size - k) % tr->size;
+		b = &tr->b[i];
+		if (b->t + step <= since)
+			break;
+		if (a->n == 0) {
+			a->min = b->min;
+			a->max = b->max;
+		} else {
+			if (b->min < a->min)
+				a->min = b->min;
+			if (b->max > a->max)
+				a->max = b->max;
+		}
+		a->sum += b->sum;
+		a->n += b->n;
+	}
+}
+
+/* Whether a tier still holds everything since the given time. */
+static int
+tier_covers(const struct tier *tr, time_t since)
+{
+	if (tr->count == 0)
+		return 0;
+	return tr->count < tr->size ||
+	    tr->b[(tr->head + 1) % tr->size].t <= since;
+}
+
+/*
+ * Optional on-disk log of every sample under <weechat_dir>/sysinfo/.
+ * A file is a magic followed by segments, one per session: a tag 0
+ * header naming the metrics, then records of varint(metric + 1) and
+ * zigzag varints of the seconds since the previous record and of the
+ * change since that metric's previous value, doubles in hundredths.
+ * Records are buffered and written every record.flush seconds; past
+ * record.size bytes the log moves to sysinfo.log.1 and so on.
+ */
+#define RECORD_MAGIC	"WSYSLOG1"
+#define RECORD_FILE	"sysinfo.log"
+#define RECORD_BUFSIZE	65536
+
+static int		 record_enabled = 0;
+static long		 record_size = 16 * 1024 * 1024;
+static int		 record_keep = 4;
+static int		 record_flush = 60;
+static int		 record_fd = -1;
+static off_t		 record_off;
+static time_t		 record_t;	/* previous record */
+static time_t		 record_flushed;
+static int64_t		 record_prev[NINFOS];
+static uint8_t		 record_buf[RECORD_BUFSIZE];
+static size_t		 record_len;
+
+static size_t
+varint_put(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+
+	return n;
+}
+
+static int
+varint_get(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+#define ZIGZAG(x)	(((uint64_t)(x) << 1) ^ (uint64_t)((x) >> 63))
+#define UNZIGZAG(u)	((int64_t)((u) >> 1) ^ -(int64_t)((u) & 1))
+
+static void
+record_path(char *buf, size_t size, const char *name)
+{
+	snprintf(buf, size, "%s/sysinfo/%s",
+	    weechat_info_get("weechat_dir", ""), name);
+}
+
+static void record_stop(void);
+
+static void
+record_error(const char *what)
+{
+	weechat_printf(NULL, "%ssysinfo: %s: %s, recording stopped",
+	    weechat_prefix("error"), what, strerror(errno));
+	record_len = 0;
+	record_stop();
+}
+
+static void
+record_header(void)
+{
+	size_t i, len;
+
+	record_buf[record_len++] = 0;
+	record_len += varint_put(record_buf + record_len, NINFOS);
+	for (i = 0; i < NINFOS; i++) {
+		len = strlen(infos[i].name);
+		record_len += varint_put(record_buf + record_len, len);
+		memcpy(record_buf + record_len, infos[i].name, len);
+		record_len += len;
+		record_buf[record_len++] = infos[i].type;
+	}
+	memset(record_prev, 0, sizeof(record_prev));
+	record_t = 0;
+}
+
+static void
+record_open(void)
+{
+	char		path[1024];
+	struct stat	st;
+
+	weechat_mkdir_home("sysinfo", 0755);
+	record_path(path, sizeof(path), RECORD_FILE);
+	if ((record_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1 ||
+	    fstat(record_fd, &st) == -1) {
+		record_error(path);
+		return;
+	}
+	record_off = st.st_size;
+	record_len = 0;
+	if (record_off == 0) {
+		memcpy(record_buf, RECORD_MAGIC, 8);
+		record_len = 8;
+	}
+	record_header();
+	record_flushed = time(NULL);
+}
+
+static void
+record_rotate(void)
+{
+	char	from[1024], to[1024], name[32];
+	int	i;
+
+	close(record_fd);
+	record_fd = -1;
+	for (i = record_keep; i > 0; i--) {
+		snprintf(name, sizeof(name), RECORD_FILE ".%d", i);
+		record_path(to, sizeof(to), name);
+		if (i > 1)
+			snprintf(name, sizeof(name), RECORD_FILE ".%d", i - 1);
+		else
+			snprintf(name, sizeof(name), RECORD_FILE);
+		record_path(from, sizeof(from), name);
+		rename(from, to);
+	}
+	if (record_keep == 0) {
+		record_path(from, sizeof(from), RECORD_FILE);
+		unlink(from);
+	}
+	record_open();
+}
+
+static void
+record_write(void)
+{
+	size_t	off = 0;
+	ssize_t	n;
+
+	while (off < record_len) {
+		if ((n = write(record_fd, record_buf + off,
+		    record_len - off)) == -1) {
+			record_error(RECORD_FILE);
+			return;
+		}
+		off += n;
+	}
+	record_off += record_len;
+	record_len = 0;
+	record_flushed = time(NULL);
+	if (record_off >= record_size)
+		record_rotate();
+}
+
+static void
+record_append(const struct info *in, time_t t, double v)
+{
+	size_t	i = in - infos;
+	int64_t	x;
+
+	if (record_fd == -1)
+		return;
+	if (in->type == INFO_U64)
+		x = (int64_t)v;
+	else
+		x = (int64_t)(v * 100 + (v < 0 ? -0.5 : 0.5));
+
+	/* Three varints of at most ten bytes each. */
+	if (record_len + 30 > RECORD_BUFSIZE) {
+		record_write();
+		if (record_fd == -1)
+			return;
+	}
+	record_len += varint_put(record_buf + record_len, i + 1);
+	record_len += varint_put(record_buf + record_len,
+	    ZIGZAG((int64_t)(t - record_t)));
+	record_len += varint_put(record_buf + record_len,
+	    ZIGZAG(x - record_prev[i]));
+	record_t = t;
+	record_prev[i] = x;
+	if (record_off + (off_t)record_len >= record_size)
+		record_write();
+}
+
+static void
+record_start(void)
+{
+	if (record_fd == -1)
+		record_open();
+}
+
+static void
+record_stop(void)
+{
+	if (record_fd == -1)
+		return;
+	if (record_len)
+		record_write();
+	/* A failed write has closed it already. */
+	if (record_fd != -1)
+		close(record_fd);
+	record_fd = -1;
+	record_len = 0;
+}
+
+/*
+ * Stream the file through a read-only mapping and print per-metric
+ * aggregates of the records at or after since.  Metrics are matched by
+ * name, so logs from other versions of the plugin replay as well.
+ */
+static void
+record_replay(struct t_gui_buffer *buffer, const char *file, time_t since)
+{
+	char		 path[1024], name[64];
+	struct stat	 st;
+	struct aggr	 a[NINFOS];
+	const uint8_t	*base, *p, *end;
+	int64_t		*prev = NULL, x;
+	int		*map = NULL, *type = NULL, fd;
+	uint64_t	 u, n = 0, len, tag, records = 0;
+	time_t		 t = 0, first = 0, last = 0;
+	size_t		 i, j;
+	void		*tmp;
+
+	/* Include what is still in the write buffer. */
+	if (record_fd != -1 && record_len)
+		record_write();
+	if (strchr(file, '/'))
+		snprintf(path, sizeof(path), "%s", file);
+	else
+		record_path(path, sizeof(path), file);
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		weechat_printf(buffer, "%ssysinfo: %s: %s",
+		    weechat_prefix("error"), path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	if (st.st_size < 8 || (base = mmap(NULL, st.st_size, PROT_READ,
+	    MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		weechat_printf(buffer, "%ssysinfo: %s: not a sysinfo log",
+		    weechat_prefix("error"), path);
+		close(fd);
+		return;
+	}
+	close(fd);
+	madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+	end = base + st.st_size;
+	memset(a, 0, sizeof(a));
+
+	p = base + 8;
+	if (memcmp(base, RECORD_MAGIC, 8))
+		p = end;
+	while (p < end) {
+		if (varint_get(&p, end, &tag))
+			break;
+		if (tag == 0) {
+			if (varint_get(&p, end, &n) || n > 4096)
+				break;
+			if ((tmp = realloc(map, (n + 1) * sizeof(*map))) == NULL)
+				break;
+			map = tmp;
+			if ((tmp = realloc(type, (n + 1) * sizeof(*type))) == NULL)
+				break;
+			type = tmp;
+			if ((tmp = realloc(prev, (n + 1) * sizeof(*prev))) == NULL)
+				break;
+			prev = tmp;
+			for (i = 0; i < n; i++) {
+				if (varint_get(&p, end, &len) ||
+				    len >= (uint64_t)(end - p) ||
+				    len >= sizeof(name))
+					break;
+				memcpy(name, p, len);
+				name[len] = '\0';
+				p += len;
+				type[i] = *p++;
+				map[i] = -1;
+				for (j = 0; j < NINFOS; j++)
+					if (!strcmp(infos[j].name, name))
+						map[i] = j;
+				prev[i] = 0;
+			}
+			if (i < n)
+				break;
+			t = 0;
+			continue;
+		}
+		if (tag > n || varint_get(&p, end, &u))
+			break;
+		t += UNZIGZAG(u);
+		if (varint_get(&p, end, &u))
+			break;
+		x = prev[tag - 1] += UNZIGZAG(u);
+		if (t < since || map[tag - 1] < 0)
+			continue;
+		if (records++ == 0 || t < first)
+			first = t;
+		if (t > last)
+			last = t;
+		aggr_add(&a[map[tag - 1]],
+		    type[tag - 1] == INFO_U64 ? (double)x : x / 100.0);
+	}
+	munmap((void *)base, st.st_size);
+	free(map);
+	free(type);
+	free(prev);
+
+	weechat_printf(buffer, "Replay %s: %llu records, %lds span%s", file,
+	    (unsigned long long)records, (long)(last - first),
+	    p < end ? " (truncated)" : "");
+	for (i = 0; i < NINFOS; i++)
+		if (a[i].n)
+			weechat_printf(buffer, "  %s: min %.2f, max %.2f, "
+			    "avg %.2f, last %.2f (%zu samples)",
+			    infos[i].name + 8, a[i].min, a[i].max,
+			    a[i].sum / a[i].n, a[i].last, a[i].n);
+}
+
+static double
+info_value_of(const weenfo *w, const struct info *in)
+{
+	const char *p = (const char *)w + in->off;
+
+	if (in->type == INFO_U64)
+		return (double)*(const uint64_t *)p;
+	return *(const double *)p;
+}
+
+static double
+info_value(const struct info *in)
+{
+	return info_value_of(&snapshot, in);
+}
+
+static void
+history_append(const struct collector *c)
+{
+	size_t i, k;
+
+	for (i = 0; i < NINFOS; i++)
+		if (infos[i].type != INFO_STR &&
+		    !strcmp(infos[i].collector, c->name)) {
+			ring_append(&infos[i].hist, c->last.tv_sec,
+			    info_value(&infos[i]));
+			series_append(&infos[i].store, c->last.tv_sec,
+			    info_value(&infos[i]));
+			for (k = 0; k < NTIERS; k++)
+				tier_add(&infos[i].tiers[k], tier_step[k],
+				    c->last.tv_sec, info_value(&infos[i]));
+			record_append(&infos[i], c->last.tv_sec,
+			    info_value(&infos[i]));
+		}
+}
+
+static void
+history_resize(size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < NINFOS; i++) {
+		if (infos[i].type == INFO_STR)
+			continue;
+		if (infos[i].hist.size != size)
+			ring_resize(&infos[i].hist, size);
+		tier_resize(&infos[i].tiers[0], TIER_MINUTES);
+		tier_resize(&infos[i].tiers[1],
+		    history_retention / tier_step[1] + 1);
+	}
+}
+
+static void
+history_end(void)
+{
+	size_t i, k;
+
+	for (i = 0; i < NINFOS; i++) {
+		ring_free(&infos[i].hist);
+		series_free(&infos[i].store);
+		for (k = 0; k < NTIERS; k++) {
+			free(infos[i].tiers[k].b);
+			memset(&infos[i].tiers[k], 0,
+			    sizeof(infos[i].tiers[k]));
+		}
+	}
+}
+
+static struct info *
+metric_find(const char *name)
+{
+	char	full[64];
+	size_t	i;
+
+	for (i = 0; i < sizeof(metric_aliases) / sizeof(metric_aliases[0]);
+	    i++)
+		if (!strcmp(metric_aliases[i].alias, name))
+			name = metric_aliases[i].name;
+	if (strncmp(name, "sysinfo_", 8)) {
+		snprintf(full, sizeof(full), "sysinfo_%s", name);
+		name = full;
+	}
+	for (i = 0; i < NINFOS; i++)
+		if (infos[i].type != INFO_STR && !strcmp(infos[i].name, name))
+			return &infos[i];
+	return NULL;
+}
+
+/*
+ * "4096", "64k", "16M", "1G"; -1 if it is none of those.
+ */
+static long
+parse_size(const char *s)
+{
+	char	*end;
+	long	 n;
+
+	n = strtol(s, &end, 10);
+	if (end == s || n < 0)
+		return -1;
+	switch (*end) {
+	case '\0':
+		break;
+	case 'k':
+	case 'K':
+		n <<= 10;
+		break;
+	case 'M':
+		n <<= 20;
+		break;
+	case 'G':
+		n <<= 30;
+		break;
+	default:
+		return -1;
+	}
+	if (*end && end[1])
+		return -1;
+
+	return n;
+}
+
+/*
+ * "90", "30s", "10m", "2h", "7d"; -1 if it is none of those.
+ */
+static long
+parse_duration(const char *s)
+{
+	char	*end;
+	long	 n;
+
+	n = strtol(s, &end, 10);
+	if (end == s || n < 0)
+		return -1;
+	switch (*end) {
+	case '\0':
+	case 's':
+		break;
+	case 'm':
+		n *= 60;
+		break;
+	case 'h':
+		n *= 3600;
+		break;
+	case 'd':
+		n *= 86400;
+		break;
+	default:
+		return -1;
+	}
+	if (*end && end[1])
+		return -1;
+
+	return n;
+}
+
+static struct collector *
+collector_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < NCOLLECTORS; i++)
+		if (!strcmp(collectors[i].name, name) ||
+		    (collectors[i].alias && !strcmp(collectors[i].alias, name)))
+			return &collectors[i];
+	return NULL;
+}
+
+static int64_t
+mono_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+lat_add(struct lat *l, int64_t ns)
+{
+	int	b = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+
+	l->b[b < LAT_BUCKETS ? b : LAT_BUCKETS - 1]++;
+	l->n++;
+	if ((uint64_t)ns > l->max)
+		l->max = ns;
+}
+
+/* The upper bound of the bucket holding quantile q, at most the max. */
+static uint64_t
+lat_quantile(const struct lat *l, double q)
+{
+	uint64_t	seen = 0, want = q * l->n;
+	int		b;
+
+	for (b = 0; b < LAT_BUCKETS - 1; b++)
+		if ((seen += l->b[b]) > want)
+			break;
+	return b == 0 ? 0 : ((uint64_t)1 << b) - 1 < l->max ?
+	    ((uint64_t)1 << b) - 1 : l->max;
+}
+
+static void
+collector_done(struct collector *c)
+{
+	gettimeofday(&sample_work.last[c - collectors], NULL);
+	sample_work.runs[c - collectors]++;
+}
+
+static int
+collector_call(struct collector *c)
+{
+	int64_t	t0, ns;
+	long	us;
+	int	rc;
+
+	PROBE1(collector__entry, c->name);
+	t0 = mono_ns();
+	rc = c->func(&sample_work.w);
+	ns = mono_ns() - t0;
+	PROBE2(collector__return, c->name, ns);
+	lat_add(&sample_work.lat[c - collectors], ns);
+	us = ns / 1000;
+	c->cost_us = c->cost_us ? (c->cost_us * 7 + us) / 8 : us;
+
+	return rc;
+}
+
+/*
+ * Halve the interval when one of the collector's values moved by more
+ * than adaptive.threshold percent since its previous run, and stretch it
+ * by a quarter while they all hold still, within interval.<name>.min
+ * and .max.
+ */
+static double	adapt_prev[NINFOS];
+
+static void
+collector_adapt(struct collector *c)
+{
+	double	v, d, mag, change = 0;
+	size_t	i;
+
+	for (i = 0; i < NINFOS; i++) {
+		if (infos[i].type == INFO_STR ||
+		    strcmp(infos[i].collector, c->name))
+			continue;
+		v = info_value_of(&sample_work.w, &infos[i]);
+		d = v > adapt_prev[i] ? v - adapt_prev[i] : adapt_prev[i] - v;
+		mag = v < 0 ? -v : v;
+		if (mag < (adapt_prev[i] < 0 ? -adapt_prev[i] : adapt_prev[i]))
+			mag = adapt_prev[i] < 0 ? -adapt_prev[i] : adapt_prev[i];
+		if (mag > 0 && d * 100 / mag > change)
+			change = d * 100 / mag;
+		adapt_prev[i] = v;
+	}
+
+	if (!adaptive)
+		c->cur = c->interval;
+	else if (sample_work.runs[c - collectors] > 1 &&
+	    change > adaptive_threshold)
+		c->cur /= 2;
+	else if (sample_work.runs[c - collectors] > 1)
+		c->cur += c->cur / 4 ? c->cur / 4 : 1;
+	if (c->cur < c->imin)
+		c->cur = c->imin;
+	if (c->cur > c->imax)
+		c->cur = c->imax;
+	sample_work.cur[c - collectors] = c->cur;
+	sample_work.cost_us[c - collectors] = c->cost_us;
+}
+
+static void
+collector_run(struct collector *c)
+{
+	if (collector_call(c) == 0) {
+		collector_done(c);
+		collector_adapt(c);
+	}
+}
+
+/*
+ * Aim the next run at due, but within a quarter interval either way take
+ * the tick with the least cost already booked, the nearest on a tie, so
+ * that expensive collectors spread out instead of firing together.  due
+ * itself keeps to the interval, so nothing drifts.
+ */
+static void
+collector_schedule(struct collector *c)
+{
+	uint64_t	t, best = 0, lo;
+	long		load, bestload = -1;
+	int		k, side, slack = c->cur / 4;
+	size_t		i;
+
+	c->due += c->cur;
+	if (c->due <= sampler_tick)
+		c->due = sampler_tick + c->cur;
+	lo = c->due > sampler_tick + slack ? c->due - slack : sampler_tick + 1;
+
+	for (k = 0; k <= slack; k++)
+		for (side = -1; side <= 1; side += 2) {
+			if ((k == 0 && side < 0) ||
+			    (t = c->due + side * k) < lo)
+				continue;
+			for (i = 0, load = 0; i < NCOLLECTORS; i++)
+				if (&collectors[i] != c &&
+				    collectors[i].next == t)
+					load += collectors[i].cost_us + 1;
+			if (bestload < 0 || load < bestload) {
+				bestload = load;
+				best = t;
+			}
+		}
+	c->next = best;
+}
+
+/*
+ * Take batch entries until none are left; run_mtx is held.  A worker
+ * books its CPU time for the budget, the sampler's own is counted whole.
+ */
+static void
+run_take(int worker)
+{
+	int64_t	cpu = 0;
+	size_t	i;
+	int	rc;
+
+	while (run_next < run_n) {
+		i = run_next++;
+		pthread_mutex_unlock(&run_mtx);
+		if (worker)
+			cpu = thread_cpu_ns();
+		rc = collector_call(run_batch[i]);
+		if (worker)
+			cpu = thread_cpu_ns() - cpu;
+		pthread_mutex_lock(&run_mtx);
+		run_cpu_ns += cpu;
+		run_rc[i] = rc;
+		if (--run_left == 0)
+			pthread_cond_signal(&run_done);
+	}
+}
+
+static void *
+run_main(void *arg)
+{
+	pthread_mutex_lock(&run_mtx);
+	while (!run_quit) {
+		if (run_next < run_n)
+			run_take(1);
+		else
+			pthread_cond_wait(&run_work, &run_mtx);
+	}
+	pthread_mutex_unlock(&run_mtx);
+
+	return NULL;
+}
+
+static void
+run_start(void)
+{
+	while (run_nthreads < run_workers &&
+	    pthread_create(&run_threads[run_nthreads], NULL, run_main,
+	    NULL) == 0)
+		run_nthreads++;
+}
+
+static void
+run_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&run_mtx);
+	run_quit = 1;
+	pthread_cond_broadcast(&run_work);
+	pthread_mutex_unlock(&run_mtx);
+	for (i = 0; i < run_nthreads; i++)
+		pthread_join(run_threads[i], NULL);
+	run_nthreads = 0;
+	run_quit = 0;
+}
+
+/*
+ * Run a batch of collectors side by side into sample_work, and stamp
+ * and reschedule them once all of them are back.
+ */
+static void
+collectors_run(struct collector **batch, size_t n)
+{
+	size_t i;
+
+	if (n < 2 || run_nthreads == 0) {
+		for (i = 0; i < n; i++)
+			collector_run(batch[i]);
+		for (i = 0; i < n; i++)
+			collector_schedule(batch[i]);
+		return;
+	}
+
+	pthread_mutex_lock(&run_mtx);
+	for (i = 0; i < n; i++)
+		run_batch[i] = batch[i];
+	run_n = n;
+	run_next = 0;
+	run_left = n;
+	pthread_cond_broadcast(&run_work);
+	run_take(0);
+	while (run_left)
+		pthread_cond_wait(&run_done, &run_mtx);
+	run_n = 0;
+	pthread_mutex_unlock(&run_mtx);
+
+	for (i = 0; i < n; i++)
+		if (run_rc[i] == 0) {
+			collector_done(batch[i]);
+			collector_adapt(batch[i]);
+		}
+	for (i = 0; i < n; i++)
+		collector_schedule(batch[i]);
+}
+
+/* Sampler thread only: no locks, no allocation. */
+static void
+sample_publish(void)
+{
+	uint64_t	one = 1;
+	int		i = !sample_latest;
+
+	__atomic_store_n(&sample_seq[i], sample_seq[i] + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&sample_slot[i], &sample_work, sizeof(sample_work));
+#ifdef __linux__
+	if (cpu_slot[i])
+		memcpy(cpu_slot[i], cpu_load, cpu_nslots * sizeof(*cpu_load));
+#endif
+	__atomic_store_n(&sample_seq[i], sample_seq[i] + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&sample_latest, i, __ATOMIC_RELEASE);
+	if (write(sample_fd[1], &one, sizeof(one)) == -1)
+		;	/* a wakeup is already pending */
+}
+
+static void
+sample_read(struct sample *s)
+{
+	unsigned	seq;
+	int		i;
+
+	for (;;) {
+		i = __atomic_load_n(&sample_latest, __ATOMIC_ACQUIRE);
+		seq = __atomic_load_n(&sample_seq[i], __ATOMIC_ACQUIRE);
+		memcpy(s, &sample_slot[i], sizeof(*s));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(seq & 1) &&
+		    seq == __atomic_load_n(&sample_seq[i], __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/* The collectors waiting at budget level, comma separated. */
+static void
+shed_names(int level, char *buf, size_t size)
+{
+	size_t	i, len = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < NCOLLECTORS && len < size; i++)
+		if (collectors[i].shed && collectors[i].shed <= level)
+			len += snprintf(buf + len, size - len, "%s%s",
+			    len ? ", " : "", collectors[i].name);
+}
+
+#ifdef __linux__
+/* The per-core loads of the newest sample, cpu_nslots of them. */
+static void
+sample_read_cpus(struct cpuload *cpus)
+{
+	unsigned	seq;
+	int		i;
+
+	for (;;) {
+		i = __atomic_load_n(&sample_latest, __ATOMIC_ACQUIRE);
+		seq = __atomic_load_n(&sample_seq[i], __ATOMIC_ACQUIRE);
+		memcpy(cpus, cpu_slot[i], cpu_nslots * sizeof(*cpus));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(seq & 1) &&
+		    seq == __atomic_load_n(&sample_seq[i], __ATOMIC_RELAXED))
+			break;
+	}
+}
+#endif
+
+static int
+sample_cb(void *data, int fd)
+{
+	struct sample	*s = &sample_seen;
+	uint64_t	 buf[8];
+	char		 names[128];
+	size_t		 i;
+	int		 level = s->shed;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	sample_read(s);
+	if (s->shed != level) {
+		shed_names(s->shed, names, sizeof(names));
+		if (s->shed)
+			weechat_printf(NULL, "sysinfo: over the CPU budget "
+			    "of %.3g%%, deferring %s", conf_slot.budget, names);
+		else
+			weechat_printf(NULL, "sysinfo: back within the CPU "
+			    "budget");
+	}
+	memcpy(&snapshot, &s->w, sizeof(snapshot));
+	for (i = 0; i < NCOLLECTORS; i++)
+		if (s->runs[i] != collectors[i].runs) {
+			collectors[i].runs = s->runs[i];
+			collectors[i].last = s->last[i];
+			history_append(&collectors[i]);
+		}
+	if (record_fd != -1 && time(NULL) - record_flushed >= record_flush)
+		record_write();
+
+	return WEECHAT_RC_OK;
+}
+
+/* Book the last tick's CPU time against the budget and set the level. */
+static void
+budget_account(void)
+{
+	int64_t	now, spent, allow;
+
+	now = thread_cpu_ns();
+	pthread_mutex_lock(&run_mtx);
+	spent = now - budget_prev + run_cpu_ns;
+	run_cpu_ns = 0;
+	pthread_mutex_unlock(&run_mtx);
+#ifdef __linux__
+	/* The disk collector's statvfs() calls run on the probe threads. */
+	pthread_mutex_lock(&probe_mtx);
+	spent += probe_cpu_ns;
+	probe_cpu_ns = 0;
+	pthread_mutex_unlock(&probe_mtx);
+#endif
+	budget_prev = now;
+	budget_avg = budget_avg ? (budget_avg * 15 + spent) / 16 : spent;
+
+	if (budget <= 0) {
+		budget_credit = 0;
+		budget_level = 0;
+		return;
+	}
+	allow = budget * 10000000;	/* percent of a second, in ns */
+	budget_credit += allow - spent;
+	if (budget_credit > allow * BUDGET_BURST)
+		budget_credit = allow * BUDGET_BURST;
+	if (budget_credit < -allow * BUDGET_BURST)
+		budget_credit = -allow * BUDGET_BURST;
+
+	if (budget_credit < 0 && spent > allow && budget_level < SHED_MAX)
+		budget_level++;
+	else if (budget_credit >= allow * BUDGET_BURST / 2 &&
+	    budget_level > 0)
+		budget_level--;
+}
+
+/* Sampler thread, or the main one before it starts. */
+static void
+conf_apply(const struct sampler_conf *c)
+{
+	size_t	i;
+
+	for (i = 0; i < NCOLLECTORS; i++)
+		/* A new interval takes effect on the next tick. */
+		if (c->interval[i] != collectors[i].interval ||
+		    c->imin[i] != collectors[i].imin ||
+		    c->imax[i] != collectors[i].imax) {
+			collectors[i].interval = collectors[i].cur =
+			    c->interval[i];
+			collectors[i].imin = c->imin[i];
+			collectors[i].imax = c->imax[i];
+			collectors[i].due = collectors[i].next = 0;
+		}
+	if (c->adaptive != adaptive) {
+		adaptive = c->adaptive;
+		for (i = 0; i < NCOLLECTORS; i++) {
+			collectors[i].cur = collectors[i].interval;
+			collectors[i].due = collectors[i].next = 0;
+		}
+	}
+	adaptive_threshold = c->adaptive_threshold;
+	if (c->budget != budget) {
+		budget = c->budget;
+		budget_credit = 0;
+		budget_level = 0;
+	}
+	cpuload_top = c->cpuload_top;
+	run_workers = c->run_workers;
+	if (run_nthreads != run_workers) {
+		run_stop();
+		run_start();
+	}
+
+#ifdef __linux__
+	pthread_mutex_lock(&probe_mtx);
+	disk_timeout = c->disk_timeout;
+	disk_workers = c->disk_workers;
+	free(disk_fstypes);
+	free(disk_mounts);
+	disk_fstypes = list_split(c->disk_fstypes, &disk_nfstypes);
+	disk_mounts = list_split(c->disk_mounts, &disk_nmounts);
+	pthread_mutex_unlock(&probe_mtx);
+	__atomic_store_n(&mounts_dirty, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Apply conf_slot if it changed and is not being written. */
+static void
+conf_take(void)
+{
+	struct sampler_conf	c;
+	unsigned		seq;
+
+	seq = __atomic_load_n(&conf_seq, __ATOMIC_ACQUIRE);
+	if (seq == conf_taken || (seq & 1))
+		return;
+	memcpy(&c, &conf_slot, sizeof(c));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (seq != __atomic_load_n(&conf_seq, __ATOMIC_RELAXED))
+		return;
+	conf_taken = seq;
+	conf_apply(&c);
+}
+
+static void *
+sampler_main(void *arg)
+{
+	struct collector	*due[NCOLLECTORS];
+	struct timespec		 next;
+	uint64_t		 gen;
+	size_t			 i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&sampler_mtx);
+	budget_prev = thread_cpu_ns();
+	for (;;) {
+		next.tv_sec++;
+		while (!sampler_quit && pthread_cond_timedwait(&sampler_wake,
+		    &sampler_mtx, &next) != ETIMEDOUT)
+			;
+		if (sampler_quit)
+			break;
+		pthread_mutex_unlock(&sampler_mtx);
+
+		conf_take();
+		sampler_tick++;
+		budget_account();
+		gen = __atomic_load_n(&lat_gen, __ATOMIC_ACQUIRE);
+		if (gen != sample_work.lat_gen) {
+			memset(sample_work.lat, 0, sizeof(sample_work.lat));
+			sample_work.lat_gen = gen;
+		}
+		for (i = 0, n = 0; i < NCOLLECTORS; i++)
+			if (collectors[i].next <= sampler_tick &&
+			    (collectors[i].shed == 0 ||
+			    collectors[i].shed > budget_level))
+				due[n++] = &collectors[i];
+		if (n || sample_work.shed != budget_level) {
+			if (n)
+				collectors_run(due, n);
+			sample_work.cpu_ns = budget_avg;
+			sample_work.shed = budget_level;
+			sample_publish();
+		}
+		pthread_mutex_lock(&sampler_mtx);
+	}
+	pthread_mutex_unlock(&sampler_mtx);
+
+	return NULL;
+}
+
+static int
+sample_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sampler_wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+#ifdef __linux__
+	if ((sample_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		return 1;
+	sample_fd[1] = sample_fd[0];
+#else
+	if (pipe(sample_fd) == -1)
+		return 1;
+	fcntl(sample_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(sample_fd[1], F_SETFL, O_NONBLOCK);
+#endif
+	sample_hook = weechat_hook_fd(sample_fd[0], 1, 0, 0, &sample_cb,
+	    NULL);
+
+	return 0;
+}
+
+static void
+sampler_start(void)
+{
+	sampler_quit = 0;
+	if (sample_hook &&
+	    pthread_create(&sampler_thread, NULL, sampler_main, NULL) == 0)
+		sampler_running = 1;
+}
+
+static void
+sampler_stop(void)
+{
+	if (sampler_running) {
+		pthread_mutex_lock(&sampler_mtx);
+		sampler_quit = 1;
+		pthread_cond_signal(&sampler_wake);
+		pthread_mutex_unlock(&sampler_mtx);
+		pthread_join(sampler_thread, NULL);
+		sampler_running = 0;
+	}
+	if (sample_hook) {
+		weechat_unhook(sample_hook);
+		sample_hook = NULL;
+	}
+	if (sample_fd[1] != -1 && sample_fd[1] != sample_fd[0])
+		close(sample_fd[1]);
+	if (sample_fd[0] != -1)
+		close(sample_fd[0]);
+	sample_fd[0] = sample_fd[1] = -1;
+	pthread_cond_destroy(&sampler_wake);
+}
+
+static void
+config_read(void)
+{
+	struct sampler_conf	 c;
+	char			 opt[64], *end;
+	const char		*val;
+	double			 d;
+	size_t			 i;
+	int			 n, lo, hi;
+
+	if (conf_seq == 0) {
+		/* The first time round, start from the built-in values. */
+		memset(&c, 0, sizeof(c));
+		c.adaptive = adaptive;
+		c.adaptive_threshold = adaptive_threshold;
+		c.budget = budget;
+		c.disk_timeout = disk_timeout;
+		c.disk_workers = disk_workers;
+		c.run_workers = run_workers;
+		c.cpuload_top = cpuload_top;
+	} else
+		memcpy(&c, &conf_slot, sizeof(c));
+
+	for (i = 0; i < NCOLLECTORS; i++) {
+		snprintf(opt, sizeof(opt), "interval.%s", collectors[i].name);
+		val = weechat_config_get_plugin(opt);
+		n = val ? atoi(val) : 0;
+		if (n < 1)
+			n = collectors[i].defint;
+		snprintf(opt, sizeof(opt), "interval.%s.min",
+		    collectors[i].name);
+		val = weechat_config_get_plugin(opt);
+		lo = val && atoi(val) > 0 ? atoi(val) : n / 5;
+		snprintf(opt, sizeof(opt), "interval.%s.max",
+		    collectors[i].name);
+		val = weechat_config_get_plugin(opt);
+		hi = val && atoi(val) > 0 ? atoi(val) : n * 4;
+		if (lo < 1)
+			lo = 1;
+		if (lo > n)
+			lo = n;
+		if (hi < n)
+			hi = n;
+		c.interval[i] = n;
+		c.imin[i] = lo;
+		c.imax[i] = hi;
+	}
+	val = weechat_config_get_plugin("adaptive");
+	c.adaptive = val == NULL || weechat_config_string_to_boolean(val);
+	if ((val = weechat_config_get_plugin("adaptive.threshold")) != NULL &&
+	    atoi(val) > 0)
+		c.adaptive_threshold = atoi(val);
+	if ((val = weechat_config_get_plugin("budget")) != NULL &&
+	    (d = strtod(val, &end)) >= 0 && end != val)
+		c.budget = d;
+
+	if ((val = weechat_config_get_plugin("disk.timeout")) != NULL &&
+	    atoi(val) > 0)
+		c.disk_timeout = atoi(val);
+	if ((val = weechat_config_get_plugin("disk.workers")) != NULL &&
+	    atoi(val) > 0)
+		c.disk_workers = atoi(val) < PROBE_MAXWORKERS ?
+		    atoi(val) : PROBE_MAXWORKERS;
+	if ((val = weechat_config_get_plugin("sampler.workers")) != NULL &&
+	    atoi(val) >= 0)
+		c.run_workers = atoi(val) < RUN_MAXWORKERS ?
+		    atoi(val) : RUN_MAXWORKERS;
+	if ((val = weechat_config_get_plugin("history.size")) != NULL &&
+	    atoi(val) > 0)
+		history_size = atoi(val);
+	if ((val = weechat_config_get_plugin("history.retention")) != NULL &&
+	    parse_duration(val) > 0)
+		history_retention = parse_duration(val);
+	history_resize(history_size);
+	if ((val = weechat_config_get_plugin("record.size")) != NULL &&
+	    parse_size(val) > 0)
+		record_size = parse_size(val);
+	if ((val = weechat_config_get_plugin("record.keep")) != NULL &&
+	    atoi(val) >= 0)
+		record_keep = atoi(val);
+	if ((val = weechat_config_get_plugin("record.flush")) != NULL &&
+	    atoi(val) > 0)
+		record_flush = atoi(val);
+	val = weechat_config_get_plugin("record.enabled");
+	record_enabled = val && weechat_config_string_to_boolean(val);
+	if (record_enabled)
+		record_start();
+	else
+		record_stop();
+	if ((val = weechat_config_get_plugin("bar.interval")) != NULL &&
+	    atoi(val) > 0)
+		bar_interval = atoi(val);
+	if (bar_fields)
+		weechat_string_free_split(bar_fields);
+	bar_fields = weechat_string_split(
+	    weechat_config_get_plugin("bar.fields"), ",", 0, 0,
+	    &bar_nfields);
+	if (bar_fields == NULL)
+		bar_nfields = 0;
+	if ((val = weechat_config_get_plugin("cpuload.top")) != NULL &&
+	    atoi(val) >= 0)
+		c.cpuload_top = atoi(val) < CPULOAD_MAXTOP ?
+		    atoi(val) : CPULOAD_MAXTOP;
+
+#ifdef __linux__
+	val = weechat_config_get_plugin("disk.fstypes");
+	snprintf(c.disk_fstypes, sizeof(c.disk_fstypes), "%s",
+	    val ? val : "");
+	val = weechat_config_get_plugin("disk.mounts");
+	snprintf(c.disk_mounts, sizeof(c.disk_mounts), "%s", val ? val : "");
+#endif
+
+	/* Hand it to the sampler, or apply it now if there is none yet. */
+	__atomic_store_n(&conf_seq, conf_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&conf_slot, &c, sizeof(c));
+	__atomic_store_n(&conf_seq, conf_seq + 1, __ATOMIC_RELEASE);
+	if (!sampler_running)
+		conf_take();
+}
+
+static int
+config_cb(void *data, const char *option, const char *value)
+{
+	config_read();
+	return WEECHAT_RC_OK;
+}
+
+#ifdef __linux__
+/* Only read at load: the files stay open. */
+static void
+config_root(const char *opt, char *root, size_t size)
+{
+	const char	*val;
+
+	if (!weechat_config_is_set_plugin(opt))
+		weechat_config_set_plugin(opt, root);
+	else if ((val = weechat_config_get_plugin(opt)) != NULL && *val)
+		snprintf(root, size, "%s", val);
+}
+#endif
+
+static void
+config_init(void)
+{
+	char	opt[64], val[16];
+	size_t	i;
+
+	for (i = 0; i < NCOLLECTORS; i++) {
+		snprintf(opt, sizeof(opt), "interval.%s", collectors[i].name);
+		if (!weechat_config_is_set_plugin(opt)) {
+			snprintf(val, sizeof(val), "%d", collectors[i].defint);
+			weechat_config_set_plugin(opt, val);
+		}
+	}
+	if (!weechat_config_is_set_plugin("adaptive"))
+		weechat_config_set_plugin("adaptive", "on");
+	if (!weechat_config_is_set_plugin("adaptive.threshold")) {
+		snprintf(val, sizeof(val), "%d", adaptive_threshold);
+		weechat_config_set_plugin("adaptive.threshold", val);
+	}
+	if (!weechat_config_is_set_plugin("budget")) {
+		snprintf(val, sizeof(val), "%g", budget);
+		weechat_config_set_plugin("budget", val);
+	}
+	if (!weechat_config_is_set_plugin("disk.timeout")) {
+		snprintf(val, sizeof(val), "%d", disk_timeout);
+		weechat_config_set_plugin("disk.timeout", val);
+	}
+	if (!weechat_config_is_set_plugin("disk.workers")) {
+		snprintf(val, sizeof(val), "%d", disk_workers);
+		weechat_config_set_plugin("disk.workers", val);
+	}
+	if (!weechat_config_is_set_plugin("sampler.workers")) {
+		snprintf(val, sizeof(val), "%d", run_workers);
+		weechat_config_set_plugin("sampler.workers", val);
+	}
+	if (!weechat_config_is_set_plugin("history.size")) {
+		snprintf(val, sizeof(val), "%zu", history_size);
+		weechat_config_set_plugin("history.size", val);
+	}
+	if (!weechat_config_is_set_plugin("history.retention"))
+		weechat_config_set_plugin("history.retention", "30d");
+	if (!weechat_config_is_set_plugin("record.enabled"))
+		weechat_config_set_plugin("record.enabled", "off");
+	if (!weechat_config_is_set_plugin("record.size"))
+		weechat_config_set_plugin("record.size", "16M");
+	if (!weechat_config_is_set_plugin("record.keep")) {
+		snprintf(val, sizeof(val), "%d", record_keep);
+		weechat_config_set_plugin("record.keep", val);
+	}
+	if (!weechat_config_is_set_plugin("record.flush")) {
+		snprintf(val, sizeof(val), "%d", record_flush);
+		weechat_config_set_plugin("record.flush", val);
+	}
+	if (!weechat_config_is_set_plugin("bar.interval")) {
+		snprintf(val, sizeof(val), "%d", bar_interval);
+		weechat_config_set_plugin("bar.interval", val);
+	}
+	if (!weechat_config_is_set_plugin("bar.fields"))
+		weechat_config_set_plugin("bar.fields", BAR_FIELDS);
+	if (!weechat_config_is_set_plugin("cpuload.top")) {
+		snprintf(val, sizeof(val), "%d", cpuload_top);
+		weechat_config_set_plugin("cpuload.top", val);
+	}
+#ifdef __linux__
+	if (!weechat_config_is_set_plugin("disk.fstypes"))
+		weechat_config_set_plugin("disk.fstypes", DISK_FSTYPES);
+	if (!weechat_config_is_set_plugin("disk.mounts"))
+		weechat_config_set_plugin("disk.mounts", DISK_MOUNTS);
+	config_root("root.proc", proc_root, sizeof(proc_root));
+	config_root("root.sys", sys_root, sizeof(sys_root));
+	config_root("root.mtab", mtab_path, sizeof(mtab_path));
+#endif
+	config_read();
+}
+
+/*
+ * Age in seconds of the oldest cached field that went into the line.
+ */
+static long
+line_age(const struct collector *c, long age)
+{
+	struct timeval	now;
+	long		a;
+
+	if (c->runs == 0)
+		return age;
+	gettimeofday(&now, NULL);
+	a = now.tv_sec - c->last.tv_sec;
+	return a > age ? a : age;
+}
+
+/* Format a collector's part of the snapshot, timing it. */
+static void
+collector_show(struct collector *c, struct line_t *line)
+{
+	int64_t	t0;
+
+	if (c->runs == 0)
+		return;		/* not sampled yet */
+	t0 = mono_ns();
+	c->format(c, &snapshot, line);
+	lat_add(&lat_show[c - collectors], mono_ns() - t0);
+}
+
+static void
+bar_render(struct baritem *b, struct line_t *line)
+{
+	struct collector	*c;
+	int			 i;
 
-		total += mntbuf[i].f_blocks * mntbuf[i].f_bsize;
-		used  += mntbuf[i].f_bfree * mntbuf[i].f_bsize;
+	if (b->field) {
+		if ((c = collector_find(b->field)) != NULL)
+			collector_show(c, line);
+		return;
 	}
-	used = total - used;
+	for (i = 0; i < bar_nfields; i++)
+		if ((c = collector_find(bar_fields[i])) != NULL)
+			collector_show(c, line);
+}
+
+static void
+bar_refresh(void)
+{
+	struct line_t	line;
+	size_t		i;
+
+	for (i = 0; i < NBARITEMS; i++) {
+		line.len = 0;
+		line.str[0] = '\0';
+		bar_render(&baritems[i], &line);
+		if (line.len > LINESIZE - 1)
+			line.len = LINESIZE - 1;
+		line.str[line.len] = '\0';
+		if (strcmp(line.str, baritems[i].text)) {
+			memcpy(baritems[i].text, line.str, line.len + 1);
+			weechat_bar_item_update(baritems[i].name);
+		}
+	}
+}
+
+static int
+bar_timer_cb(void *data, int remaining_calls)
+{
+	bar_refresh();
+	if (bar_hooked != bar_interval) {
+		weechat_unhook(bar_hook);
+		bar_hooked = bar_interval;
+		bar_hook = weechat_hook_timer(bar_hooked * 1000, 0, 0,
+		    &bar_timer_cb, NULL);
+	}
+
+	return WEECHAT_RC_OK;
+}
+
+static char *
+bar_item_cb(void *data, struct t_gui_bar_item *item,
+    struct t_gui_window *window)
+{
+	return strdup(((struct baritem *)data)->text);
+}
+
+static void
+bar_init(void)
+{
+	size_t i;
+
+	bar_refresh();
+	for (i = 0; i < NBARITEMS; i++)
+		weechat_bar_item_new(baritems[i].name, &bar_item_cb,
+		    &baritems[i]);
+	bar_hooked = bar_interval;
+	bar_hook = weechat_hook_timer(bar_hooked * 1000, 0, 0,
+	    &bar_timer_cb, NULL);
+}
+
+static const char *
+info_format(const struct info *in, char *buf, size_t size)
+{
+	const char *p = (const char *)&snapshot + in->off;
+
+	switch (in->type) {
+	case INFO_STR:
+		return p;
+	case INFO_U64:
+		snprintf(buf, size, "%llu",
+		    (unsigned long long)*(const uint64_t *)p);
+		break;
+	case INFO_DOUBLE:
+		snprintf(buf, size, "%.2f", *(const double *)p);
+		break;
+	}
+
+	return buf;
+}
+
+static const char *
+info_cb(void *data, const char *info_name, const char *arguments)
+{
+	static char buf[32];
+
+	return info_format(data, buf, sizeof(buf));
+}
+
+/*
+ * The whole snapshot in one call: every info above without its "sysinfo_"
+ * prefix, plus "time_<collector>", when that collector last sampled.
+ */
+static struct t_hashtable *
+info_hashtable_cb(void *data, const char *info_name,
+    struct t_hashtable *hashtable)
+{
+	struct t_hashtable	*ht;
+	char			 buf[32], key[64];
+	size_t			 i;
+
+	ht = weechat_hashtable_new(NINFOS + NCOLLECTORS,
+	    WEECHAT_HASHTABLE_STRING, WEECHAT_HASHTABLE_STRING, NULL, NULL);
+	if (ht == NULL)
+		return NULL;
+
+	for (i = 0; i < NINFOS; i++)
+		weechat_hashtable_set(ht, infos[i].name + strlen("sysinfo_"),
+		    info_format(&infos[i], buf, sizeof(buf)));
+	for (i = 0; i < NCOLLECTORS; i++) {
+		snprintf(key, sizeof(key), "time_%s", collectors[i].name);
+		snprintf(buf, sizeof(buf), "%ld",
+		    (long)collectors[i].last.tv_sec);
+		weechat_hashtable_set(ht, key, buf);
+	}
+
+	return ht;
+}
+
+#ifdef __linux__
+
+/*
+ * One item per mount or per core, optionally filtered by a mask on the
+ * mountpoint or on the core name ("cpu3").  64-bit sizes do not fit an
+ * infolist integer, so they are passed as strings, and so are the
+ * percentages.
+ */
+static struct t_infolist *
+infolist_mounts_cb(void *data, const char *infolist_name, void *pointer,
+    const char *arguments)
+{
+	struct t_infolist	*list;
+	struct t_infolist_item	*item;
+	struct mount		*m;
+	char			 buf[32];
+	size_t			 i;
+
+	if ((list = weechat_infolist_new()) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&probe_mtx);
+	for (i = 0; i < nmounts; i++) {
+		m = mounts[i];
+		if (arguments && arguments[0] &&
+		    !weechat_string_match(m->dir, arguments, 1))
+			continue;
+		if ((item = weechat_infolist_new_item(list)) == NULL)
+			break;
+		weechat_infolist_new_var_string(item, "dir", m->dir);
+		weechat_infolist_new_var_string(item, "fstype", m->fstype);
+		weechat_infolist_new_var_string(item, "source", m->source);
+		weechat_infolist_new_var_integer(item, "counted", m->counted);
+		weechat_infolist_new_var_integer(item, "valid", m->valid);
+		weechat_infolist_new_var_integer(item, "stale", m->stale);
+		weechat_infolist_new_var_integer(item, "probe_us",
+		    (int)m->probe_us);
+		snprintf(buf, sizeof(buf), "%llu",
+		    (unsigned long long)(m->total >> 10));
+		weechat_infolist_new_var_string(item, "total_kb", buf);
+		snprintf(buf, sizeof(buf), "%llu",
+		    (unsigned long long)(m->used >> 10));
+		weechat_infolist_new_var_string(item, "used_kb", buf);
+		snprintf(buf, sizeof(buf), "%.2f",
+		    m->total ? (double)m->used * 100 / m->total : 0);
+		weechat_infolist_new_var_string(item, "used_pct", buf);
+	}
+	pthread_mutex_unlock(&probe_mtx);
+
+	return list;
+}
+
+static struct t_infolist *
+infolist_cpus_cb(void *data, const char *infolist_name, void *pointer,
+    const char *arguments)
+{
+	struct t_infolist	*list;
+	struct t_infolist_item	*item;
+	struct cpuload		*cpus, *l;
+	char			 name[16], buf[16];
+	int			 i;
+
+	if ((list = weechat_infolist_new()) == NULL)
+		return NULL;
+	if (cpu_nslots == 0 ||
+	    (cpus = malloc(cpu_nslots * sizeof(*cpus))) == NULL)
+		return list;
+
+	/* cpu_load belongs to the sampler thread; this is its last sample. */
+	sample_read_cpus(cpus);
+	for (i = 1; i < cpu_nslots; i++) {
+		l = &cpus[i];
+		snprintf(name, sizeof(name), "cpu%d", i - 1);
+		if (arguments && arguments[0] &&
+		    !weechat_string_match(name, arguments, 0))
+			continue;
+		if ((item = weechat_infolist_new_item(list)) == NULL)
+			break;
+		weechat_infolist_new_var_string(item, "name", name);
+		weechat_infolist_new_var_integer(item, "cpu", i - 1);
+		weechat_infolist_new_var_integer(item, "online", l->online);
+		weechat_infolist_new_var_integer(item, "mhz",
+		    l->khz ? (int)(l->khz / 1000) : (int)cpu_model_mhz);
+		snprintf(buf, sizeof(buf), "%.2f", l->busy);
+		weechat_infolist_new_var_string(item, "busy", buf);
+		snprintf(buf, sizeof(buf), "%.2f", l->user);
+		weechat_infolist_new_var_string(item, "user", buf);
+		snprintf(buf, sizeof(buf), "%.2f", l->system);
+		weechat_infolist_new_var_string(item, "system", buf);
+		snprintf(buf, sizeof(buf), "%.2f", l->iowait);
+		weechat_infolist_new_var_string(item, "iowait", buf);
+		snprintf(buf, sizeof(buf), "%.2f", l->steal);
+		weechat_infolist_new_var_string(item, "steal", buf);
+	}
+	free(cpus);
+
+	return list;
+}
+
+#endif /* __linux__ */
+
+static void
+info_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < NINFOS; i++)
+		weechat_hook_info(infos[i].name, infos[i].desc, NULL,
+		    &info_cb, &infos[i]);
+	weechat_hook_info_hashtable("sysinfo",
+	    "all sysinfo values at once", NULL,
+	    "os_name, cpu_mhz, load1, mem_used_kb, ... (the sysinfo_* infos "
+	    "without prefix), time_<collector> (last sample, epoch)",
+	    &info_hashtable_cb, NULL);
+
+#ifdef __linux__
+	weechat_hook_infolist("sysinfo_mounts", "mounts and their usage",
+	    NULL, "mountpoint mask (optional)", &infolist_mounts_cb, NULL);
+	weechat_hook_infolist("sysinfo_cpus", "per-core clock and usage",
+	    NULL, "core name mask, e.g. \"cpu1*\" (optional)",
+	    &infolist_cpus_cb, NULL);
 #endif
+}
+
+static void
+history_line(struct line_t *line, char **argv, int argc)
+{
+	struct info		*in;
+	struct aggr		 a;
+	struct ring		*r;
+	struct series_usage	 u;
+	char			 buf[LINESIZE];
+	time_t			 since;
+	size_t			 i;
+	long			 window, res;
+	int			 k;
+
+	if (argc == 3 && !strcmp(argv[2], "stats")) {
+		memset(&u, 0, sizeof(u));
+		for (i = 0; i < NINFOS; i++)
+			if (infos[i].type != INFO_STR)
+				series_usage(&infos[i].store, &u);
+		snprintf(buf, sizeof(buf), "History: %zu samples in %zu "
+		    "compressed bytes (%.2f bytes/sample), %zu not yet "
+		    "compressed, %zu bytes fixed", u.nsealed, u.sealed,
+		    u.nsealed ? (double)u.sealed / u.nsealed : 0, u.nopen,
+		    u.fixed);
+		add_to_line(line, buf);
+		return;
+	}
 
-	snprintf(info->disk, sizeof(info->disk),
-	    "Disk Usage: %.2fGB/%.2fGB",
-	    (float)used / (1 << 30),
-	    (float)total / (1 << 30));
+	if (argc < 4 || (in = metric_find(argv[2])) == NULL ||
+	    (window = parse_duration(argv[3])) < 0 ||
+	    (res = argc > 4 ? parse_duration(argv[4]) :
+	    window / HISTORY_POINTS) < 0) {
+		add_to_line(line, "History: usage: history <metric> <window> "
+		    "[resolution] | history stats");
+		return;
+	}
+
+	/*
+	 * The coarsest source that is fine enough and still reaches back
+	 * far enough: hourly rollups, minute rollups, the ring, and the
+	 * compressed store as a last resort.
+	 */
+	since = time(NULL) - window;
+	r = &in->hist;
+	for (k = NTIERS - 1; k >= 0; k--)
+		if (tier_step[k] <= res && tier_covers(&in->tiers[k], since))
+			break;
+	if (k >= 0) {
+		tier_aggregate(&in->tiers[k], tier_step[k], since, &a);
+		a.last = info_value(in);
+	} else if (r->count && (r->count < r->size ||
+	    r->t[r->head] <= since))
+		ring_aggregate(r, since, &a);
+	else
+		series_aggregate(&in->store, since, &a);
+	if (a.n == 0)
+		snprintf(buf, sizeof(buf), "History %s (%s): no samples",
+		    in->name + 8, argv[3]);
+	else
+		snprintf(buf, sizeof(buf), "History %s (%s): min %.2f, "
+		    "max %.2f, avg %.2f, last %.2f (%zu samples)",
+		    in->name + 8, argv[3], a.min, a.max, a.sum / a.n,
+		    a.last, a.n);
+	add_to_line(line, buf);
+}
+
+static int
+get_weenfo(struct line_t *line, char **argv, int argc, long *age)
+{
+	struct collector	*c;
+	size_t			 i;
+
+	*age = 0;
+	if ((argc < 2) || !strcmp(argv[1], "all")) {
+		for (i = 0; i < NCOLLECTORS; i++) {
+			c = &collectors[i];
+			if (c->flags & C_ALL) {
+				collector_show(c, line);
+				*age = line_age(c, *age);
+			}
+		}
+	} else if ((c = collector_find(argv[1])) != NULL) {
+		collector_show(c, line);
+		*age = c->runs ? line_age(c, *age) : -1;
+	} else
+		*age = -1;	/* nothing to date */
 
 	return 0;
 }
 
+/*
+ * The intervals the sampler is using right now, as of the last sample.
+ */
 static void
-add_to_line(struct line_t *line, char *p)
+rates_print(struct t_gui_buffer *buffer, char **argv, int argc)
 {
-	int	 i;
-	char	*lp = line->str + line->len;
+	struct collector	*c;
+	char			 names[128];
+	size_t			 i;
+	long			 cur, us;
 
-	if (line->len && 3 < LINESIZE - line->len) {
-		*lp++ = ' ';
-		*lp++ = '-';
-		*lp++ = ' ';
-		line->len += 3;
+	shed_names(sample_seen.shed, names, sizeof(names));
+	weechat_printf(buffer, "sampler: %.3f%% of a core, budget %.3g%%%s%s",
+	    sample_seen.cpu_ns / 1e7, conf_slot.budget,
+	    sample_seen.shed ? ", deferring " : "", names);
+	for (i = 0; i < NCOLLECTORS; i++) {
+		c = &collectors[i];
+		cur = conf_slot.adaptive && sample_seen.cur[i] ?
+		    sample_seen.cur[i] : conf_slot.interval[i];
+		us = sample_seen.cost_us[i];
+		if (conf_slot.adaptive)
+			weechat_printf(buffer, "%s: every %lds (%d-%ds, "
+			    "interval %ds), %ld.%03ldms a run", c->name, cur,
+			    conf_slot.imin[i], conf_slot.imax[i],
+			    conf_slot.interval[i], us / 1000, us % 1000);
+		else
+			weechat_printf(buffer, "%s: every %lds, "
+			    "%ld.%03ldms a run", c->name, cur, us / 1000,
+			    us % 1000);
 	}
+}
 
-	for (i = 0; *p && i < LINESIZE - line->len; i++) {
-		*lp++ = *p++;
+static char *
+lat_str(char *buf, size_t size, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%luns", (unsigned long)ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, size, "%.1fs", ns / 1e9);
+	return buf;
+}
+
+static void
+lat_print(struct t_gui_buffer *buffer, const char *name, const char *what,
+    const struct lat *l)
+{
+	char	p50[16], p99[16], max[16];
+
+	if (l->n == 0)
+		weechat_printf(buffer, "%s: %s: no calls", name, what);
+	else
+		weechat_printf(buffer, "%s: %s: %lu calls, p50 %s, p99 %s, "
+		    "max %s", name, what, (unsigned long)l->n,
+		    lat_str(p50, sizeof(p50), lat_quantile(l, 0.5)),
+		    lat_str(p99, sizeof(p99), lat_quantile(l, 0.99)),
+		    lat_str(max, sizeof(max), l->max));
+}
+
+/*
+ * How long each collector takes to sample, on the sampler's side, and
+ * to format, on ours.  Percentiles are to the power of two.
+ */
+static void
+stats_print(struct t_gui_buffer *buffer, char **argv, int argc)
+{
+	static const struct lat	 none;
+	size_t			 i;
+
+	if (argc > 2 && !strcmp(argv[2], "reset")) {
+		__atomic_store_n(&lat_gen, lat_gen + 1, __ATOMIC_RELEASE);
+		memset(lat_show, 0, sizeof(lat_show));
+		weechat_printf(buffer, "Stats: reset");
+		return;
 	}
-	line->len += i;
+	for (i = 0; i < NCOLLECTORS; i++) {
+		lat_print(buffer, collectors[i].name, "collect",
+		    sample_seen.lat_gen == lat_gen ?
+		    &sample_seen.lat[i] : &none);
+		lat_print(buffer, collectors[i].name, "format",
+		    &lat_show[i]);
+	}
+}
+
+/*
+ * Send a line for /sys or print it for /esys, with its age unless that
+ * is negative.
+ */
+static void
+line_out(struct t_gui_buffer *buffer, const char *cmd, struct line_t *line,
+    long age)
+{
+	if (!strcmp(cmd, "/sys"))
+		weechat_command(buffer, line->str);
+	else if (!strcmp(cmd, "/esys") && age < 0)
+		weechat_printf (buffer, "%s", line->str);
+	else if (!strcmp(cmd, "/esys"))
+		weechat_printf (buffer, "%s (%lds old)", line->str, age);
+}
+
+static void
+history_print(struct t_gui_buffer *buffer, char **argv, int argc)
+{
+	struct line_t	line = {"\0", 0};
+
+	history_line(&line, argv, argc);
+	line_out(buffer, argv[0], &line, -1);
+}
+
+static void
+replay_print(struct t_gui_buffer *buffer, char **argv, int argc)
+{
+	if (argc < 3)
+		weechat_printf(buffer, "Replay: usage: replay <file> "
+		    "[<window> | all]");
+	else if (argc > 3 && strcmp(argv[3], "all") &&
+	    parse_duration(argv[3]) < 0)
+		weechat_printf(buffer, "Replay: bad window %s", argv[3]);
+	else
+		record_replay(buffer, argv[2],
+		    argc > 3 && strcmp(argv[3], "all") ?
+		    time(NULL) - parse_duration(argv[3]) : 0);
+}
+
+/*
+ * Subcommands that are not collectors.  The arguments and completion of
+ * both commands are built from these and the collector table, and
+ * weenfo_run looks them up here.
+ */
+static const struct subcmd {
+	const char	*name;
+	void		(*func)(struct t_gui_buffer *, char **, int);
+	int		 esys;		/* /esys only */
+	const char	*usage;
+} subcmds[] = {
+	{ "history",	history_print,	0,	"history <metric> <window> "
+	    "[resolution] | history stats" },
+#ifdef __linux__
+	{ "mounts",	mounts_print,	1,	"mounts" },
+#endif
+	{ "rates",	rates_print,	1,	"rates" },
+	{ "replay",	replay_print,	1,	"replay <file> "
+	    "[<window> | all]" },
+	{ "stats",	stats_print,	1,	"stats [reset]" },
+};
+
+static const struct subcmd *
+subcmd_find(const char *name)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(subcmds) / sizeof(subcmds[0]); i++)
+		if (!strcmp(name, subcmds[i].name))
+			return &subcmds[i];
+	return NULL;
 }
 
 static int
-get_weenfo(struct line_t *line, char **argv, int argc)
+weenfo_run(struct t_gui_buffer *buffer, int argc, char **argv)
 {
-	weenfo info;
+	const struct subcmd	*sc;
+	struct line_t		 line = {"\0", 0};
+	long			 age;
 
-	if ((argc < 2) || !strcmp(argv[1], "all")) {
-		cpu_info(&info);
-		uname_info(&info);
-		uptime_info(&info);
-		load_info(&info);
-		mem_info(&info);
-		disk_info(&info);
-
-		add_to_line(line, info.uname);
-		add_to_line(line, info.cpu);
-		add_to_line(line, info.uptime);
-		add_to_line(line, info.load);
-		add_to_line(line, info.mem);
-		add_to_line(line, info.disk);
-	} else if (!strcmp(argv[1], "uname") || !strcmp(argv[1], "os")) {
-		uname_info(&info);
-		add_to_line(line, info.uname);
-	} else if (!strcmp(argv[1], "cpu")) {
-		cpu_info(&info);
-		add_to_line(line, info.cpu);
-	} else if (!strcmp(argv[1], "mem")) {
-		mem_info(&info);
-		add_to_line(line, info.mem);
-	} else if (!strcmp(argv[1], "disk")) {
-		disk_info(&info);
-		add_to_line(line, info.disk);
-	} else if (!strcmp(argv[1], "uptime")) {
-		uptime_info(&info);
-		add_to_line(line, info.uptime);
-	} else if (!strcmp(argv[1], "load")) {
-		load_info(&info);
-		add_to_line(line, info.load);
+	if (argc > 1 && (sc = subcmd_find(argv[1])) != NULL) {
+		if (!sc->esys || !strcmp(argv[0], "/esys"))
+			sc->func(buffer, argv, argc);
+		return WEECHAT_RC_OK;
 	}
 
-	return 0;
+	get_weenfo(&line, argv, argc, &age);
+	line_out(buffer, argv[0], &line, age);
+
+	return WEECHAT_RC_OK;
 }
 
 static int
 weenfo_cmd(void *data, struct t_gui_buffer *buffer, int argc,
     char **argv, char **argv_eol)
 {
-	struct line_t line = {"\0", 0};
+#ifdef HAVE_SYS_SDT_H
+	const char	*sub = argc > 1 ? argv[1] : "all";
+	int64_t		 t0;
+	int		 rc;
+
+	/* The clock is only read with a tracer attached. */
+	if (PROBE_ENABLED(command__entry) || PROBE_ENABLED(command__return)) {
+		PROBE2(command__entry, argv[0], sub);
+		t0 = mono_ns();
+		rc = weenfo_run(buffer, argc, argv);
+		PROBE3(command__return, argv[0], sub, mono_ns() - t0);
+		return rc;
+	}
+#endif
+	return weenfo_run(buffer, argc, argv);
+}
+
+/*
+ * /upgrade re-execs WeeChat and us with it.  The previous /proc/stat
+ * counters, the CPU model and the history go through the upgrade file,
+ * so the first sample afterwards already has something to diff against.
+ * Everything is matched by name and size, a changed layout is dropped.
+ */
+#define UPGRADE_FILE	"sysinfo"
+#define UPGRADE_VERSION	1
+
+enum { UPGRADE_STATE = 1, UPGRADE_HISTORY, UPGRADE_BLOCK };
+
+static int	upgrade_pending = 0;
+static int	upgrade_skip = 0;
+
+static int
+upgrade_signal_cb(void *data, const char *signal, const char *type_data,
+    void *signal_data)
+{
+	upgrade_pending = 1;
+	return WEECHAT_RC_OK;
+}
+
+static int
+upgrade_save_state(struct t_upgrade_file *f)
+{
+	struct t_infolist	*il;
+	struct t_infolist_item	*item;
+	int			 rc = 0;
+
+	if ((il = weechat_infolist_new()) == NULL)
+		return 0;
+	if ((item = weechat_infolist_new_item(il)) != NULL) {
+		weechat_infolist_new_var_integer(item, "version",
+		    UPGRADE_VERSION);
+#ifdef __linux__
+		weechat_infolist_new_var_string(item, "cpu_model", cpu_model);
+		weechat_infolist_new_var_buffer(item, "cpu_model_mhz",
+		    &cpu_model_mhz, sizeof(cpu_model_mhz));
+		if (cpu_nslots)
+			weechat_infolist_new_var_buffer(item, "cpu_prev",
+			    cpu_prev, cpu_nslots * sizeof(*cpu_prev));
+#endif
+		rc = weechat_upgrade_write_object(f, UPGRADE_STATE, il);
+	}
+	weechat_infolist_free(il);
+
+	return rc;
+}
+
+static int
+upgrade_save_history(struct t_upgrade_file *f)
+{
+	struct t_infolist	*il, *bl;
+	struct t_infolist_item	*item;
+	struct info		*in;
+	struct series		*s;
+	struct bucket		*b;
+	time_t			*t;
+	double			*v;
+	size_t			 i, j, k, n;
+	char			 name[8];
+	int			 rc = 0;
+
+	if ((il = weechat_infolist_new()) == NULL)
+		return 0;
+	if ((bl = weechat_infolist_new()) == NULL) {
+		weechat_infolist_free(il);
+		return 0;
+	}
+	for (i = 0; i < NINFOS; i++) {
+		in = &infos[i];
+		if (in->type == INFO_STR)
+			continue;
+		if ((item = weechat_infolist_new_item(il)) == NULL)
+			goto out;
+		weechat_infolist_new_var_string(item, "name", in->name);
+
+		/* Ring and tiers go oldest first. */
+		n = in->hist.count;
+		t = n ? malloc(n * sizeof(*t)) : NULL;
+		v = n ? malloc(n * sizeof(*v)) : NULL;
+		if (t && v) {
+			for (j = 0; j < n; j++) {
+				k = (in->hist.head + in->hist.size - n + j) %
+				    in->hist.size;
+				t[j] = in->hist.t[k];
+				v[j] = in->hist.v[k];
+			}
+			weechat_infolist_new_var_buffer(item, "ring_t", t,
+			    n * sizeof(*t));
+			weechat_infolist_new_var_buffer(item, "ring_v", v,
+			    n * sizeof(*v));
+		}
+		free(t);
+		free(v);
+		for (k = 0; k < NTIERS; k++) {
+			n = in->tiers[k].count;
+			if (n == 0 || (b = malloc(n * sizeof(*b))) == NULL)
+				continue;
+			for (j = 0; j < n; j++)
+				b[j] = in->tiers[k].b[(in->tiers[k].head + 1 +
+				    in->tiers[k].size - n + j) %
+				    in->tiers[k].size];
+			snprintf(name, sizeof(name), "tier%zu", k);
+			weechat_infolist_new_var_buffer(item, name, b,
+			    n * sizeof(*b));
+			free(b);
+		}
+
+		s = &in->store;
+		if (s->hn) {
+			weechat_infolist_new_var_buffer(item, "open_t", s->ht,
+			    s->hn * sizeof(*s->ht));
+			weechat_infolist_new_var_buffer(item, "open_v", s->hv,
+			    s->hn * sizeof(*s->hv));
+		}
+		for (j = s->first; j < s->nblocks; j++) {
+			if ((item = weechat_infolist_new_item(bl)) == NULL)
+				goto out;
+			weechat_infolist_new_var_string(item, "name",
+			    in->name);
+			weechat_infolist_new_var_time(item, "t0",
+			    s->blocks[j].t0);
+			weechat_infolist_new_var_time(item, "t1",
+			    s->blocks[j].t1);
+			weechat_infolist_new_var_integer(item, "n",
+			    s->blocks[j].n);
+			weechat_infolist_new_var_buffer(item, "data",
+			    s->blocks[j].data, s->blocks[j].len);
+		}
+	}
+	rc = weechat_upgrade_write_object(f, UPGRADE_HISTORY, il) &&
+	    weechat_upgrade_write_object(f, UPGRADE_BLOCK, bl);
+out:
+	weechat_infolist_free(il);
+	weechat_infolist_free(bl);
+
+	return rc;
+}
+
+static void
+upgrade_save(void)
+{
+	struct t_upgrade_file *f;
+
+	if ((f = weechat_upgrade_new(UPGRADE_FILE, 1)) == NULL)
+		return;
+	if (upgrade_save_state(f))
+		upgrade_save_history(f);
+	weechat_upgrade_close(f);
+}
+
+static void
+upgrade_read_state(struct t_infolist *il)
+{
+#ifdef __linux__
+	const char	*model;
+	void		*p;
+	int		 size;
+
+	if ((model = weechat_infolist_string(il, "cpu_model")) != NULL &&
+	    (p = weechat_infolist_buffer(il, "cpu_model_mhz", &size)) &&
+	    size == sizeof(cpu_model_mhz)) {
+		snprintf(cpu_model, sizeof(cpu_model), "%s", model);
+		memcpy(&cpu_model_mhz, p, size);
+		cpu_model_known = 1;
+	}
+	if ((p = weechat_infolist_buffer(il, "cpu_prev", &size)) &&
+	    size == (int)(cpu_nslots * sizeof(*cpu_prev)))
+		memcpy(cpu_prev, p, size);
+#endif
+}
+
+static void
+upgrade_read_history(struct t_infolist *il)
+{
+	struct info	*in;
+	struct tier	*tr;
+	struct series	*s;
+	time_t		*t;
+	double		*v;
+	struct bucket	*b;
+	const char	*p;
+	char		 name[8];
+	int		 ts, vs, i, k, n;
+
+	if ((p = weechat_infolist_string(il, "name")) == NULL ||
+	    (in = metric_find(p)) == NULL)
+		return;
+	t = weechat_infolist_buffer(il, "ring_t", &ts);
+	v = weechat_infolist_buffer(il, "ring_v", &vs);
+	if (t && v && ts / sizeof(*t) == vs / sizeof(*v))
+		for (i = 0; i < (int)(ts / sizeof(*t)); i++)
+			ring_append(&in->hist, t[i], v[i]);
+
+	for (k = 0; k < NTIERS; k++) {
+		snprintf(name, sizeof(name), "tier%d", k);
+		tr = &in->tiers[k];
+		if ((b = weechat_infolist_buffer(il, name, &ts)) == NULL ||
+		    tr->size == 0)
+			continue;
+		n = ts / sizeof(*b);
+		if ((size_t)n > tr->size) {
+			b += n - tr->size;
+			n = tr->size;
+		}
+		memcpy(tr->b, b, n * sizeof(*b));
+		tr->count = n;
+		tr->head = n - 1;
+	}
+
+	s = &in->store;
+	t = weechat_infolist_buffer(il, "open_t", &ts);
+	v = weechat_infolist_buffer(il, "open_v", &vs);
+	if (t && v && ts == vs && ts <= (int)sizeof(s->ht)) {
+		memcpy(s->ht, t, ts);
+		memcpy(s->hv, v, vs);
+		s->hn = ts / sizeof(*t);
+	}
+}
 
-	get_weenfo(&line, argv, argc);
-	if (!strcmp(argv[0], "/sys"))
-		weechat_command(buffer, line.str);
-	else if (!strcmp(argv[0], "/esys"))
-		weechat_printf (buffer, "%s", line.str);
+static void
+upgrade_read_block(struct t_infolist *il)
+{
+	struct info	*in;
+	struct series	*s;
+	struct block	*blk;
+	const char	*p;
+	void		*data;
+	int		 size;
+
+	if ((p = weechat_infolist_string(il, "name")) == NULL ||
+	    (in = metric_find(p)) == NULL ||
+	    (data = weechat_infolist_buffer(il, "data", &size)) == NULL ||
+	    size <= 0)
+		return;
+	s = &in->store;
+	if (s->nblocks == s->blocks_size) {
+		size_t n = s->blocks_size ? s->blocks_size * 2 : 16;
+
+		if ((blk = realloc(s->blocks, n * sizeof(*blk))) == NULL)
+			return;
+		s->blocks = blk;
+		s->blocks_size = n;
+	}
+	blk = &s->blocks[s->nblocks];
+	if ((blk->data = malloc(size)) == NULL)
+		return;
+	memcpy(blk->data, data, size);
+	blk->len = size;
+	blk->n = weechat_infolist_integer(il, "n");
+	blk->t0 = weechat_infolist_time(il, "t0");
+	blk->t1 = weechat_infolist_time(il, "t1");
+	s->nblocks++;
+}
+
+static int
+upgrade_read_cb(void *data, struct t_upgrade_file *f, int id,
+    struct t_infolist *il)
+{
+	while (weechat_infolist_next(il)) {
+		if (id == UPGRADE_STATE)
+			upgrade_skip = weechat_infolist_integer(il,
+			    "version") != UPGRADE_VERSION;
+		if (upgrade_skip)
+			continue;
+		switch (id) {
+		case UPGRADE_STATE:
+			upgrade_read_state(il);
+			break;
+		case UPGRADE_HISTORY:
+			upgrade_read_history(il);
+			break;
+		case UPGRADE_BLOCK:
+			upgrade_read_block(il);
+			break;
+		}
+	}
 
 	return WEECHAT_RC_OK;
 }
 
+static void
+upgrade_load(void)
+{
+	struct t_upgrade_file *f;
+
+	if ((f = weechat_upgrade_new(UPGRADE_FILE, 0)) == NULL)
+		return;
+	weechat_upgrade_read(f, &upgrade_read_cb, NULL);
+	weechat_upgrade_close(f);
+}
+
+static char	cmd_args[2][LINESIZE];
+static char	cmd_completion[2][LINESIZE];
+
+static void
+cmd_append(char *buf, const char *sep, const char *s)
+{
+	size_t len = strlen(buf);
+
+	snprintf(buf + len, LINESIZE - len, "%s%s", sep, s);
+}
+
+static void
+cmd_init(void)
+{
+	size_t	i;
+	int	e;
+	char	buf[64];
+
+	for (e = 0; e < 2; e++) {
+		strcpy(cmd_args[e], "all");
+		strcpy(cmd_completion[e], "all");
+		for (i = 0; i < NCOLLECTORS; i++) {
+			if (collectors[i].alias)
+				snprintf(buf, sizeof(buf), "%s|%s",
+				    collectors[i].name, collectors[i].alias);
+			else
+				snprintf(buf, sizeof(buf), "%s",
+				    collectors[i].name);
+			cmd_append(cmd_args[e], " | ", buf);
+			cmd_append(cmd_completion[e], "|", buf);
+		}
+		for (i = 0; i < sizeof(subcmds) / sizeof(subcmds[0]); i++)
+			if (e || !subcmds[i].esys) {
+				cmd_append(cmd_args[e], " | ", subcmds[i].usage);
+				cmd_append(cmd_completion[e], "|",
+				    subcmds[i].name);
+			}
+	}
+}
+
 int
 weechat_plugin_init (struct t_weechat_plugin *plugin,
     int argc, char *argv[])
 {
+	struct collector	*all[NCOLLECTORS];
+	size_t			 i, n;
+	int			 upgrading = 0;
+
 	weechat_plugin = plugin;
 
+	for (i = 0; i < (size_t)argc; i++)
+		if (!strcmp(argv[i], "--upgrade"))
+			upgrading = 1;
+
+	config_init();
+#ifdef __linux__
+	procfs_init();
+	cpu_init();
+	probe_init();
+#endif
+	if (upgrading)
+		upgrade_load();
+#ifdef __linux__
+	if (!cpu_model_known)
+		cpu_model_read();
+#endif
+	/*
+	 * The first sample is taken here, so there is something to show,
+	 * but without the collectors that can block: the sampler thread's
+	 * first tick fills those in.
+	 */
+	sample_init();
+	for (i = n = 0; i < NCOLLECTORS; i++)
+		if (!(collectors[i].flags & C_SLOW))
+			all[n++] = &collectors[i];
+	collectors_run(all, n);
+	sample_publish();
+	sample_cb(NULL, sample_fd[0]);
+	sampler_start();
+
+	bar_init();
+	info_init();
+	weechat_hook_config("plugins.var.sysinfo.*", &config_cb, NULL);
+	weechat_hook_signal("upgrade", &upgrade_signal_cb, NULL);
+
+	cmd_init();
 	weechat_hook_command("sys",
 	    "Send system informations",
-	    "all | cpu | mem | uname|os | disk | uptime | load",
+	    cmd_args[0],
 	    NULL,
-	    "all|cpu|mem|uname|os|disk|uptime|load",
+	    cmd_completion[0],
 	    &weenfo_cmd,
 	    NULL);
 
 	weechat_hook_command("esys",
 	    "Display system informations",
-	    "all | cpu | mem | uname|os | disk | uptime | load",
+	    cmd_args[1],
 	    NULL,
-	    "all|cpu|mem|uname|os|disk|uptime|load",
+	    cmd_completion[1],
 	    &weenfo_cmd,
 	    NULL);
 
 	return WEECHAT_RC_OK;
 }
 
+int
+weechat_plugin_end (struct t_weechat_plugin *plugin)
+{
+	sampler_stop();
+	if (bar_hook) {
+		weechat_unhook(bar_hook);
+		bar_hook = NULL;
+	}
+	if (bar_fields) {
+		weechat_string_free_split(bar_fields);
+		bar_fields = NULL;
+	}
+	run_stop();
+	if (upgrade_pending)
+		upgrade_save();
+	record_stop();
+	history_end();
+#ifdef __linux__
+	probe_end();
+	cpu_end();
+	procfs_end();
+#endif
+
+	return WEECHAT_RC_OK;
+}
+
 /* vim: set foldmethod=expr foldexpr=MyCFL(): */